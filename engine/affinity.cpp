@@ -0,0 +1,167 @@
+/*
+ * PZChessBot, a UCI chess engine
+ * Copyright (C) 2026 Kevin Lu and William Ma
+ *
+ * PZChessBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * PZChessBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with PZChessBot. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "affinity.hpp"
+
+#include <sstream>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+CPUAffinity affinity;
+
+// Parses the sysfs list format, e.g. "0-3,8,10-11". Returns an empty vector on malformed input.
+static std::vector<int> parse_cpu_list(const std::string &str) {
+	std::vector<int> cpus;
+	std::stringstream ss(str);
+	std::string part;
+	while (std::getline(ss, part, ',')) {
+		if (part.empty())
+			continue;
+		size_t dash = part.find('-');
+		try {
+			int lo = std::stoi(part.substr(0, dash));
+			int hi = dash == std::string::npos ? lo : std::stoi(part.substr(dash + 1));
+			if (lo < 0 || hi < lo || hi >= 65536)
+				return {};
+			for (int cpu = lo; cpu <= hi; cpu++)
+				cpus.push_back(cpu);
+		} catch (...) {
+			return {};
+		}
+	}
+	return cpus;
+}
+
+#ifdef __linux__
+// Reads a single integer from a sysfs file, or returns -1
+static int read_sysfs_int(const std::string &path) {
+	std::ifstream file(path);
+	int val;
+	return file >> val ? val : -1;
+}
+
+// CPUs this process may run on, captured before any thread changes its own mask
+static const cpu_set_t &initial_mask() {
+	static const cpu_set_t mask = [] {
+		cpu_set_t m;
+		CPU_ZERO(&m);
+		if (sched_getaffinity(0, sizeof(m), &m) != 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				CPU_SET(cpu, &m);
+		}
+		return m;
+	}();
+	return mask;
+}
+
+struct CPUTopology {
+	int cpu, package, core, smt; // smt is the index of the CPU among its core's siblings
+};
+
+static std::vector<CPUTopology> read_topology() {
+	std::ifstream file("/sys/devices/system/cpu/online");
+	std::string online;
+	std::getline(file, online);
+
+	std::vector<CPUTopology> topo;
+	for (int cpu : parse_cpu_list(online)) {
+		if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &initial_mask()))
+			continue;
+		const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+		topo.push_back({cpu, std::max(0, read_sysfs_int(dir + "physical_package_id")), read_sysfs_int(dir + "core_id"), 0});
+		if (topo.back().core < 0)
+			topo.back().core = cpu; // Unknown topology, treat every CPU as its own core
+	}
+
+	// Number the siblings of each core in CPU order
+	std::sort(topo.begin(), topo.end(), [](const auto &a, const auto &b) { return std::tie(a.package, a.core, a.cpu) < std::tie(b.package, b.core, b.cpu); });
+	for (size_t i = 1; i < topo.size(); i++) {
+		if (topo[i].package == topo[i - 1].package && topo[i].core == topo[i - 1].core)
+			topo[i].smt = topo[i - 1].smt + 1;
+	}
+	return topo;
+}
+
+static bool set_mask(pthread_t th, const std::vector<int> &order, PinPolicy policy, size_t thread) {
+	if (policy == PIN_NONE || order.empty()) {
+		pthread_setaffinity_np(th, sizeof(cpu_set_t), &initial_mask());
+		return false;
+	}
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	CPU_SET(order[thread % order.size()], &mask);
+	return pthread_setaffinity_np(th, sizeof(mask), &mask) == 0;
+}
+#endif
+
+bool CPUAffinity::set_policy(PinPolicy new_policy, const std::string &list) {
+	std::vector<int> new_order;
+#ifdef __linux__
+	if (new_policy == PIN_LIST) {
+		for (int cpu : parse_cpu_list(list)) {
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &initial_mask()))
+				new_order.push_back(cpu);
+		}
+	} else if (new_policy != PIN_NONE) {
+		std::vector<CPUTopology> topo = read_topology(); // Sorted by package, core, then sibling
+		if (new_policy == PIN_PHYSICAL)
+			std::stable_sort(topo.begin(), topo.end(), [](const auto &a, const auto &b) { return a.smt < b.smt; });
+		for (const auto &t : topo)
+			new_order.push_back(t.cpu);
+	}
+#endif
+	if (new_policy != PIN_NONE && new_order.empty())
+		return false;
+
+	policy = new_policy;
+	order = new_order;
+	return true;
+}
+
+bool CPUAffinity::pin_self(size_t thread) const {
+#ifdef __linux__
+	return set_mask(pthread_self(), order, policy, thread);
+#else
+	return false;
+#endif
+}
+
+bool CPUAffinity::pin(std::thread &th, size_t thread) const {
+#ifdef __linux__
+	return set_mask(th.native_handle(), order, policy, thread);
+#else
+	return false;
+#endif
+}
+
+std::string CPUAffinity::describe() const {
+#ifndef __linux__
+	if (policy != PIN_NONE)
+		return "CPU pinning is not supported on this platform";
+#endif
+	if (policy == PIN_NONE)
+		return "Threads are not pinned";
+	const char *names[] = {"none", "physical cores first", "compact", "explicit list"};
+	std::string res = std::string("Pinning threads (") + names[policy] + ") to CPUs";
+	for (int cpu : order)
+		res += " " + std::to_string(cpu);
+	return res;
+}
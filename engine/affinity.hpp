@@ -0,0 +1,63 @@
+/*
+ * PZChessBot, a UCI chess engine
+ * Copyright (C) 2026 Kevin Lu and William Ma
+ *
+ * PZChessBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * PZChessBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with PZChessBot. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "includes.hpp"
+
+#include <vector>
+
+enum PinPolicy {
+	PIN_NONE, // Let the scheduler (or libnuma, when built with it) place threads
+	PIN_PHYSICAL, // One thread per physical core first, SMT siblings only once every core is taken
+	PIN_COMPACT, // Fill each core's SMT siblings before moving on to the next core
+	PIN_LIST, // Use the CPUs given by the user, in the given order
+};
+
+/**
+ * Chooses the CPU that each search thread is pinned to. The topology is read from sysfs, so this
+ * works without libnuma, and only CPUs the process was allowed to run on at startup are used (which
+ * respects taskset and cgroup restrictions).
+ *
+ * Thread i is pinned to `order[i % order.size()]`, so oversubscribing wraps around.
+ */
+struct CPUAffinity {
+	PinPolicy policy = PIN_NONE;
+	std::vector<int> order;
+
+	/**
+	 * Switches to a new policy. `list` is only used by PIN_LIST and uses the sysfs list format
+	 * (e.g. `0-7,16-23`). Returns false and keeps the old policy if the list is invalid or no usable
+	 * CPU is found.
+	 */
+	bool set_policy(PinPolicy policy, const std::string &list = "");
+
+	/**
+	 * Pins the calling thread according to the policy. Returns false if the policy is PIN_NONE, in
+	 * which case the thread may run on any allowed CPU.
+	 */
+	bool pin_self(size_t thread) const;
+
+	// Same as pin_self, for another thread
+	bool pin(std::thread &th, size_t thread) const;
+
+	// Describes the policy and the CPUs used, for UCI output
+	std::string describe() const;
+};
+
+extern CPUAffinity affinity;
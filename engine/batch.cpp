@@ -0,0 +1,178 @@
+/*
+ * PZChessBot, a UCI chess engine
+ * Copyright (C) 2026 Kevin Lu and William Ma
+ *
+ * PZChessBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * PZChessBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with PZChessBot. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "batch.hpp"
+
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "affinity.hpp"
+#include "mem.hpp"
+#include "search.hpp"
+
+void parse_batch_limits(std::istream &args, BatchLimits &limits) {
+	std::string token;
+	bool got_nodes = false, got_depth = false;
+	while (args >> token) {
+		if (token == "nodes") {
+			args >> limits.nodes;
+			got_nodes = true;
+		} else if (token == "depth") {
+			args >> limits.depth;
+			got_depth = true;
+		} else if (token == "workers") {
+			args >> limits.workers;
+		} else if (token == "hash") {
+			args >> limits.hash_mb;
+		}
+	}
+	if (got_depth && !got_nodes)
+		limits.nodes = UINT64_MAX;
+	limits.depth = std::clamp(limits.depth, 1, MAX_PLY);
+	limits.workers = std::clamp<size_t>(limits.workers, 1, MAX_THREADS);
+}
+
+/**
+ * Turns an EPD line (four FEN fields followed by operations) or a full FEN into a FEN. Blank lines
+ * and lines starting with '#' give an empty string.
+ */
+static std::string epd_to_fen(const std::string &line) {
+	std::stringstream ss(line);
+	std::string fields[6];
+	int n = 0;
+	while (n < 6 && ss >> fields[n])
+		n++;
+	if (n < 4 || fields[0][0] == '#')
+		return "";
+
+	std::string fen = fields[0] + " " + fields[1] + " " + fields[2] + " " + fields[3];
+	auto is_number = [](const std::string &s) { return !s.empty() && std::all_of(s.begin(), s.end(), ::isdigit); };
+	if (n == 6 && is_number(fields[4]) && is_number(fields[5]))
+		return fen + " " + fields[4] + " " + fields[5];
+	return fen + " 0 1";
+}
+
+void BatchControl::stop() {
+	std::lock_guard lock(mtx);
+	stopped = true;
+	for (std::atomic<bool> *search : searches)
+		*search = true;
+}
+
+size_t run_batch(std::istream &in, std::ostream &out, const BatchLimits &limits, BatchControl *control) {
+	std::mutex in_mtx, out_mtx;
+	std::atomic<size_t> done = 0;
+
+	auto worker = [&](size_t w) {
+		affinity.pin_self(w);
+
+		// Everything is allocated by the worker itself, so that first touch places it on its node
+		ThreadInfo *ti = new (large_alloc(sizeof(ThreadInfo))) ThreadInfo();
+		HistoryTables *tables = new (large_alloc(sizeof(HistoryTables))) HistoryTables();
+		std::unique_ptr<TTable> tt;
+		if (limits.hash_mb)
+			tt = std::make_unique<TTable>(limits.hash_mb * 1024 * 1024 / sizeof(TTable::TTBucket), false);
+		std::atomic<bool> stop = false;
+		std::vector<Move> root_moves;
+		if (control) {
+			std::lock_guard lock(control->mtx);
+			control->searches.push_back(&stop);
+		}
+
+		ti->am.net = local_network();
+		ti->hist = &tables->hist;
+		ti->corrhist = &tables->corrhist;
+		ti->decay_hist = true;
+		ti->stop = &stop;
+		ti->max_nodes = limits.nodes;
+		ti->tt = tt ? tt.get() : &ttable;
+		ti->root_moves = &root_moves;
+		ti->id = w;
+		ti->is_main = false; // Not the pool's main thread: no time management or UCI output
+
+		Position pos;
+		std::string line;
+		while (true) {
+			{
+				std::lock_guard lock(in_mtx);
+				if (!std::getline(in, line))
+					break;
+			}
+			const std::string fen = epd_to_fen(line);
+			if (fen.empty())
+				continue;
+
+			// Positions are unrelated, but the histories and TT are kept: clearing them would cost more
+			// than a short search
+			pos.reset(fen);
+			ti->rp.clear();
+			ti->rp.push_hash(pos.zobrist_without_ep());
+			root_moves = list_root_moves(pos, ti->rp);
+			ti->am.full_refresh(pos, 0);
+			ti->seldepth = 0;
+			ti->maxdepth = 0;
+			ti->eval = -VALUE_INFINITE;
+			ti->root_pvlen = 0;
+			ti->nodecnt = 0;
+			if (control) {
+				// Under the lock, so that a concurrent stop() can't be overwritten
+				std::lock_guard lock(control->mtx);
+				if (control->stopped)
+					break;
+				stop = false;
+			} else {
+				stop = false;
+			}
+			if (tt)
+				tt->inc_gen();
+
+			iterativedeepening(pos, *ti, limits.depth);
+
+			std::stringstream result;
+			result << fen << "; bestmove " << (ti->root_pvlen ? ti->root_pv[0] : NullMove).to_string() << "; score "
+				   << (ti->maxdepth ? score_to_uci(ti->eval) : "none") << "; depth " << ti->maxdepth << "; nodes " << ti->nodecnt << "\n";
+			{
+				std::lock_guard lock(out_mtx);
+				out << result.str() << std::flush;
+			}
+			// A shared TT ages once per round of `workers` positions, as fast as each private one would
+			if (done.fetch_add(1, std::memory_order_relaxed) % limits.workers == limits.workers - 1 && !tt)
+				ttable.inc_gen();
+		}
+
+		if (control) {
+			std::lock_guard lock(control->mtx);
+			std::erase(control->searches, &stop);
+		}
+		tt.reset();
+		large_free(tables, sizeof(HistoryTables));
+		ti->~ThreadInfo();
+		large_free(ti, sizeof(ThreadInfo));
+	};
+
+	if (!limits.hash_mb)
+		ttable.inc_gen(); // Entries of earlier searches are older than anything the batch stores
+	std::vector<std::thread> workers;
+	for (size_t w = 0; w < limits.workers; w++)
+		workers.emplace_back(worker, w);
+	for (auto &t : workers)
+		t.join();
+	return done.load();
+}
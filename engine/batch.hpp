@@ -0,0 +1,66 @@
+/*
+ * PZChessBot, a UCI chess engine
+ * Copyright (C) 2026 Kevin Lu and William Ma
+ *
+ * PZChessBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * PZChessBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with PZChessBot. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "includes.hpp"
+
+#include <mutex>
+#include <vector>
+
+struct BatchLimits {
+	int depth = MAX_PLY;
+	uint64_t nodes = 10000;
+	size_t workers = 1;
+	size_t hash_mb = 0; // TT size of each worker, 0 to share the global TT
+};
+
+/**
+ * Reads `nodes N`, `depth D`, `workers W` and `hash MB` pairs, in any order, into `limits`. Giving
+ * only a depth removes the default node limit.
+ */
+void parse_batch_limits(std::istream &args, BatchLimits &limits);
+
+/**
+ * Lets another thread end a run_batch early, e.g. on a UCI `stop`. Use a fresh one for every batch:
+ * once stopped it stays stopped.
+ */
+class BatchControl {
+	std::mutex mtx;
+	bool stopped = false;
+	std::vector<std::atomic<bool> *> searches; // Stop flags of the workers' searches
+
+	friend size_t run_batch(std::istream &, std::ostream &, const BatchLimits &, BatchControl *);
+
+public:
+	// Stops the searches in progress at once; the workers then exit without taking another line
+	void stop();
+};
+
+/**
+ * Analyses every position of an EPD or FEN stream with independent single-threaded searches, one
+ * per worker thread. Each worker takes the next line as soon as it is done with its previous one,
+ * so results are written in the order they finish rather than in input order, one line each:
+ *
+ *     <fen>; bestmove <move>; score <cp X | mate Y>; depth <D>; nodes <N>
+ *
+ * Returns the number of positions analysed, which is less than the whole input if `control` was
+ * stopped. The pool must be idle, since the workers use the node counters of the first `workers`
+ * search threads.
+ */
+size_t run_batch(std::istream &in, std::ostream &out, const BatchLimits &limits, BatchControl *control = nullptr);
@@ -17,6 +17,8 @@
  */
 
 #include "bitboard.hpp"
+#include "movegen.hpp"
+#include <cassert>
 #include <cctype>
 #include <random>
 
@@ -27,6 +29,59 @@ uint64_t zobrist_castling[16];
 uint64_t zobrist_ep[9];
 uint64_t zobrist_side;
 
+/**
+ * Cuckoo hash table of every reversible move, keyed by how the move changes the position's hash
+ * (the piece on both squares, plus the side to move). A move and its reverse have the same key, so
+ * each is stored once with its squares in either order. Two hash functions and 8192 slots leave
+ * room for all 3668 of them, so a lookup reads at most two slots.
+ */
+#define CUCKOO_SZ 8192
+uint64_t cuckoo_keys[CUCKOO_SZ];
+uint16_t cuckoo_squares[CUCKOO_SZ]; // src | dst << 6
+
+static inline int cuckoo_h1(uint64_t key) { return key & (CUCKOO_SZ - 1); }
+static inline int cuckoo_h2(uint64_t key) { return (key >> 16) & (CUCKOO_SZ - 1); }
+
+static void init_cuckoo() {
+	// Empty board moves, which don't depend on the (not yet initialized) attack tables
+	auto reaches = [](PieceType pt, int s1, int s2) {
+		const int dr = abs((s1 >> 3) - (s2 >> 3)), df = abs((s1 & 7) - (s2 & 7));
+		switch (pt) {
+		case KNIGHT: return dr * df == 2;
+		case BISHOP: return dr == df;
+		case ROOK: return dr == 0 || df == 0;
+		case QUEEN: return dr == df || dr == 0 || df == 0;
+		case KING: return std::max(dr, df) == 1;
+		default: return false;
+		}
+	};
+
+	int count = 0;
+	for (int color = 0; color < 2; color++) {
+		for (int pt = KNIGHT; pt <= KING; pt++) {
+			const int pc = pt + (color << 3);
+			for (int s1 = 0; s1 < 64; s1++) {
+				for (int s2 = s1 + 1; s2 < 64; s2++) {
+					if (!reaches(PieceType(pt), s1, s2))
+						continue;
+					uint64_t key = zobrist_square[s1][pc] ^ zobrist_square[s2][pc] ^ zobrist_side;
+					uint16_t squares = s1 | (s2 << 6);
+					int i = cuckoo_h1(key);
+					while (true) {
+						std::swap(cuckoo_keys[i], key);
+						std::swap(cuckoo_squares[i], squares);
+						if (key == 0)
+							break; // Found an empty slot
+						i = i == cuckoo_h1(key) ? cuckoo_h2(key) : cuckoo_h1(key);
+					}
+					count++;
+				}
+			}
+		}
+	}
+	assert(count == 3668);
+}
+
 __attribute__((constructor)) void init_zobrist() {
 	std::mt19937_64 rng(0xdeadbeef);
 	std::uniform_int_distribution<uint64_t> dist;
@@ -48,6 +103,8 @@ __attribute__((constructor)) void init_zobrist() {
 	zobrist_ep[8] = 0;
 
 	zobrist_side = dist(rng);
+
+	init_cuckoo();
 }
 
 void print_bitboard(Bitboard board) {
@@ -267,6 +324,7 @@ void Position::load_fen(std::string fen) {
 	}
 
 	// Get halfmove clock
+	plies_from_null = 0;
 	halfmove = 0;
 	while (inputIdx < fen.size() && std::isdigit(fen[inputIdx])) {
 		halfmove *= 10;
@@ -306,6 +364,7 @@ void Position::reset_pos() {
 	side = WHITE;
 	halfmove = 0;
 	fullmove = 0;
+	plies_from_null = 0;
 	castling = 0xf;  // 1111
 	ep_square = SQ_NONE;
 	rook_pos[0] = SQ_H1;
@@ -587,6 +646,7 @@ void Position::make_move(Move move) {
 			zobrist ^= zobrist_ep[ep_square & 0b111];
 			ep_square = SQ_NONE;
 		}
+		plies_from_null = 0;
 		return;
 	}
 
@@ -734,6 +794,7 @@ void Position::make_move(Move move) {
 
 	halfmove++;
 	fullmove++;
+	plies_from_null++;
 
 	update_control();
 
@@ -795,20 +856,76 @@ void Position::recompute_hash() {
 	zobrist ^= zobrist_side * side;
 }
 
-bool RepetitionHandler::threefold(int ply, uint64_t hash) {
-	int cnt = 0, plies = 0;
-	for (int idx = hash_hist.size() - 1; idx >= 0; idx--) {
-		const uint64_t& h = hash_hist[idx];
-		if (h == hash)
+/**
+ * Only positions within `window` plies (see Position::repetition_window) can repeat, and only every
+ * other one has the same side to move, so the scan is bounded by it and skips the odd plies.
+ */
+bool RepetitionHandler::threefold(int ply, uint64_t hash, int window) {
+	int cnt = 0;
+	const int end = std::min(window, (int)hash_hist.size() - 1);
+	for (int plies = 0; plies <= end; plies += 2) {
+		if (hash_hist[hash_hist.size() - 1 - plies] == hash)
 			cnt++;
 		if (plies < ply && cnt >= 2)
 			return true;
-		plies++;
 		if (cnt >= 3) return true;
 	}
 	return false;
 }
 
+/**
+ * Looks for an earlier position (an odd number of plies back, so the opponent is to move there)
+ * that differs from the current one by a single reversible move, using the cuckoo table. The move
+ * must also be playable now, i.e. nothing stands between its squares.
+ *
+ * Inside the search tree reaching any earlier position again counts as a draw, so a cycle there is
+ * enough whoever has to close it. Positions from before the root need the real threefold, so it has
+ * to be our move and the position we would return to must already have occurred twice.
+ */
+bool RepetitionHandler::upcoming_repetition(const Position &pos, int ply) const {
+	const int n = hash_hist.size();
+	const int end = std::min(pos.repetition_window(), n - 1);
+	if (end < 3)
+		return false;
+
+	const uint64_t key = hash_hist[n - 1];
+	const Bitboard occ = pos.piece_boards[OCC(WHITE)] | pos.piece_boards[OCC(BLACK)];
+	for (int i = 3; i <= end; i += 2) {
+		const uint64_t move_key = key ^ hash_hist[n - 1 - i];
+		int slot = cuckoo_h1(move_key);
+		if (cuckoo_keys[slot] != move_key) {
+			slot = cuckoo_h2(move_key);
+			if (cuckoo_keys[slot] != move_key)
+				continue;
+		}
+
+		const Square s1 = Square(cuckoo_squares[slot] & 63), s2 = Square(cuckoo_squares[slot] >> 6);
+		const Square from = pos.mailbox[s1] != NO_PIECE ? s1 : s2, to = from == s1 ? s2 : s1;
+		Bitboard reach;
+		switch (pos.mailbox[from] & 7) {
+		case KNIGHT: reach = knight_attacks(from); break;
+		case BISHOP: reach = bishop_attacks(from, occ); break;
+		case ROOK: reach = rook_attacks(from, occ); break;
+		case QUEEN: reach = queen_attacks(from, occ); break;
+		case KING: reach = king_attacks(from); break;
+		default: continue;
+		}
+		if (!(reach & square_bits(to)))
+			continue; // Something is in the way
+
+		if (ply > i)
+			return true;
+
+		if ((pos.mailbox[from] >> 3) != pos.side)
+			continue;
+		for (int k = i + 2; k <= end; k += 2) {
+			if (hash_hist[n - 1 - k] == hash_hist[n - 1 - i])
+				return true;
+		}
+	}
+	return false;
+}
+
 bool Position::insufficient_material() const {
 	Bitboard all_pieces = piece_boards[PAWN] | piece_boards[ROOK] | piece_boards[QUEEN];
 	if (all_pieces != 0) return false; // pawn/rook/queen -> mate is possible
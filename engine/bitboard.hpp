@@ -96,6 +96,7 @@ struct Position {
 	Piece mailbox[64];
 
 	int fullmove = 0;
+	int plies_from_null = 0; // Null moves don't reset the halfmove clock, so repetition scans need this too
 
 	Position() {
 		reset_pos();
@@ -132,6 +133,12 @@ struct Position {
 
 	bool insufficient_material() const;
 
+	/**
+	 * How many plies back a repetition of this position can be found. Nothing before the last
+	 * capture, pawn move or null move can repeat it.
+	 */
+	int repetition_window() const { return std::min<int>(halfmove, plies_from_null); }
+
 	uint64_t pawn_hash() const;
 	uint64_t nonpawn_hash(bool color) const;
 	uint64_t major_hash() const;
@@ -150,7 +157,14 @@ struct RepetitionHandler {
 		hash_hist.clear();
 	}
 
-	bool threefold(int ply, uint64_t hash);
+	bool threefold(int ply, uint64_t hash, int window);
+
+	/**
+	 * Whether the side to move has a reversible move that returns to an earlier position, i.e.
+	 * whether the current line can be turned into a repetition before it happens. The last entry of
+	 * `hash_hist` must be `pos`.
+	 */
+	bool upcoming_repetition(const Position &pos, int ply) const;
 
 	void push_hash(uint64_t hash) { hash_hist.push_back(hash); }
 	void pop_hash() { hash_hist.pop_back(); }
@@ -17,12 +17,53 @@
  */
 
 #include "eval.hpp"
+#include "mem.hpp"
+
+#include <mutex>
+
+#ifdef USE_NUMA
+#include <numa.h>
+#include <sched.h>
+#endif
 
 // Accumulator w_acc, b_acc;
 Network nnue_network;
 
+#ifdef USE_NUMA
+static int network_home_node = -1; // Node whose memory holds nnue_network
+#endif
+
 __attribute__((constructor)) void init_network() {
 	nnue_network.load();
+#ifdef USE_NUMA
+	if (numa_available() != -1)
+		network_home_node = numa_node_of_cpu(sched_getcpu());
+#endif
+}
+
+const Network *local_network() {
+#ifdef USE_NUMA
+	if (numa_available() == -1 || numa_num_configured_nodes() <= 1)
+		return &nnue_network;
+	const int node = numa_node_of_cpu(sched_getcpu());
+	if (node < 0 || node == network_home_node)
+		return &nnue_network;
+
+	static std::mutex mtx;
+	static std::vector<Network *> replicas(numa_num_configured_nodes(), nullptr);
+	std::lock_guard lock(mtx);
+	if (node >= (int)replicas.size())
+		return &nnue_network;
+	if (!replicas[node]) {
+		Network *replica = (Network *)large_alloc(sizeof(Network));
+		numa_tonode_memory(replica, sizeof(Network), node); // Holds even if this thread migrates while copying
+		memcpy((void *)replica, (const void *)&nnue_network, sizeof(Network));
+		replicas[node] = replica;
+	}
+	return replicas[node];
+#else
+	return &nnue_network;
+#endif
 }
 
 Value simple_eval(Position &pos) {
@@ -43,9 +84,9 @@ Value eval(Position &pos, AccumulatorManager &am) {
 	int nbucket = (npieces - 2) / 4;
 
 	if (pos.side == WHITE) {
-		score = nnue_eval(nnue_network, am.current().w_acc, am.current().b_acc, nbucket);
+		score = nnue_eval(*am.net, am.current().w_acc, am.current().b_acc, nbucket);
 	} else {
-		score = -nnue_eval(nnue_network, am.current().b_acc, am.current().w_acc, nbucket);
+		score = -nnue_eval(*am.net, am.current().b_acc, am.current().w_acc, nbucket);
 	}
 
 	const int mat_phase = PawnValue * arch::popcnt(pos.piece_boards[PAWN]) + KnightValue * arch::popcnt(pos.piece_boards[KNIGHT]) +
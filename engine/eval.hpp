@@ -26,6 +26,14 @@
 
 extern Network nnue_network;
 
+/**
+ * Returns the copy of the network on the calling thread's NUMA node, creating it on first use.
+ * The accumulator updates stream through the large feature weights constantly, so reading them
+ * from a remote node costs interconnect bandwidth on multi-socket machines. Without NUMA support
+ * (or on a single node) this is always the global network.
+ */
+const Network *local_network();
+
 Value simple_eval(Position &);
 
 Value eval(Position &pos, AccumulatorManager &am);
@@ -22,27 +22,27 @@
 int History::get_conthist(Position &pos, Move move, int ply, SSEntry *line) {
 	int score = 0;
 	if ((line - 1)->cont_hist)
-		score += (line - 1)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		score += hist_load((line - 1)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()]);
 	if ((line - 2)->cont_hist)
-		score += (line - 2)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		score += hist_load((line - 2)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()]);
 	if ((line - 3)->cont_hist)
-		score += (line - 3)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		score += hist_load((line - 3)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()]);
 	if ((line - 4)->cont_hist)
-		score += (line - 4)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		score += hist_load((line - 4)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()]);
 	if ((line - 6)->cont_hist)
-		score += (line - 6)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		score += hist_load((line - 6)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()]);
 	return score;
 }
 
 int History::get_history(Position &pos, Move move, int ply, SSEntry *line) {
-	int score = history[pos.side][move.src()][move.dst()][pos.control(move.src(), !pos.side)][pos.control(move.dst(), !pos.side)];
-	score += pawnhist[pos.side][pos.pawn_hash() % PAWNHIST_SZ][pos.mailbox[move.src()] & 7][move.dst()];
+	int score = hist_load(history[pos.side][move.src()][move.dst()][pos.control(move.src(), !pos.side)][pos.control(move.dst(), !pos.side)]);
+	score += hist_load(pawnhist[pos.side][pos.pawn_hash() % PAWNHIST_SZ][pos.mailbox[move.src()] & 7][move.dst()]);
 	score += get_conthist(pos, move, ply, line);
 	return score;
 }
 
 int History::get_capthist(Position &pos, Move move) {
-	int score = capthist[pos.side][pos.mailbox[move.src()] & 7][pos.mailbox[move.dst()] & 7][move.dst()];
+	int score = hist_load(capthist[pos.side][pos.mailbox[move.src()] & 7][pos.mailbox[move.dst()] & 7][move.dst()]);
 	return score;
 }
 
@@ -51,7 +51,8 @@ void History::update_history(Position &pos, Move &move, int ply, SSEntry *line,
 	int cbonus = std::clamp(bonus, (Value)(-MAX_HISTORY), MAX_HISTORY);
 
 	auto update_entry = [=](Value &entry) {
-		entry += cbonus - entry * abs(cbonus) / MAX_HISTORY;
+		const Value val = hist_load(entry);
+		hist_store(entry, val + cbonus - val * abs(cbonus) / MAX_HISTORY);
 	};
 
 	update_entry(history[pos.side][move.src()][move.dst()][pos.control(move.src(), !pos.side)][pos.control(move.dst(), !pos.side)]);
@@ -63,28 +64,36 @@ void History::update_history(Position &pos, Move &move, int ply, SSEntry *line,
 void History::update_conthist(Position &pos, Move move, int ply, SSEntry *line, Value bonus) {
 	int cbonus = std::clamp(bonus, (Value)(-MAX_HISTORY), MAX_HISTORY);
 	int conthist = get_conthist(pos, move, ply, line);
+	auto update_entry = [&](ContHistEntry *entry) {
+		Value &val = entry->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		hist_store(val, hist_load(val) + cbonus - conthist * abs(bonus) / MAX_HISTORY);
+	};
+
 	if ((line - 1)->cont_hist)
-		(line - 1)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()] += cbonus - conthist * abs(bonus) / MAX_HISTORY;
+		update_entry((line - 1)->cont_hist);
 	if ((line - 2)->cont_hist)
-		(line - 2)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()] += cbonus - conthist * abs(bonus) / MAX_HISTORY;
+		update_entry((line - 2)->cont_hist);
 	if ((line - 3)->cont_hist)
-		(line - 3)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()] += cbonus - conthist * abs(bonus) / MAX_HISTORY;
+		update_entry((line - 3)->cont_hist);
 	if ((line - 4)->cont_hist)
-		(line - 4)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()] += cbonus - conthist * abs(bonus) / MAX_HISTORY;
+		update_entry((line - 4)->cont_hist);
 	if ((line - 6)->cont_hist)
-		(line - 6)->cont_hist->hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()] += cbonus - conthist * abs(bonus) / MAX_HISTORY;
+		update_entry((line - 6)->cont_hist);
 }
 
 void History::update_capthist(Position &pos, Move move, Value bonus) {
 	int cbonus = std::clamp(bonus, (Value)(-MAX_HISTORY), MAX_HISTORY);
-	capthist[pos.side][pos.mailbox[move.src()] & 7][pos.mailbox[move.dst()] & 7][move.dst()] += cbonus - capthist[pos.side][pos.mailbox[move.src()] & 7][pos.mailbox[move.dst()] & 7][move.dst()] * abs(bonus) / MAX_HISTORY;
+	Value &entry = capthist[pos.side][pos.mailbox[move.src()] & 7][pos.mailbox[move.dst()] & 7][move.dst()];
+	const Value val = hist_load(entry);
+	hist_store(entry, val + cbonus - val * abs(bonus) / MAX_HISTORY);
 }
 
 // Moving exponential average for corrhist
 void Corrhist::update_corrhist(Position &pos, SSEntry *line, int ply, int bonus) {
 	auto update_entry = [=](Value &entry) {
 		int update = std::clamp(bonus, -MAX_CORRHIST / 4, MAX_CORRHIST / 4);
-		entry += update - entry * abs(update) / MAX_CORRHIST;
+		const Value val = hist_load(entry);
+		hist_store(entry, val + update - val * abs(update) / MAX_CORRHIST);
 	};
 
 	update_entry(corrhist_ps[pos.side][pos.pawn_hash() % CORRHIST_SZ]);
@@ -104,16 +113,16 @@ void Corrhist::apply_correction(Position &pos, SSEntry *line, int ply, Value &ev
 		return; // Don't apply correction if we are already at a mate score
 	
 	int corr = 0;
-	corr += corr_ps() * corrhist_ps[pos.side][pos.pawn_hash() % CORRHIST_SZ];
-	corr += corr_np() * corrhist_np[pos.side][WHITE][pos.nonpawn_hash(WHITE) % CORRHIST_SZ];
-	corr += corr_np() * corrhist_np[pos.side][BLACK][pos.nonpawn_hash(BLACK) % CORRHIST_SZ];
-	corr += corr_maj() * corrhist_maj[pos.side][pos.major_hash() % CORRHIST_SZ];
-	corr += corr_min() * corrhist_min[pos.side][pos.minor_hash() % CORRHIST_SZ];
+	corr += corr_ps() * hist_load(corrhist_ps[pos.side][pos.pawn_hash() % CORRHIST_SZ]);
+	corr += corr_np() * hist_load(corrhist_np[pos.side][WHITE][pos.nonpawn_hash(WHITE) % CORRHIST_SZ]);
+	corr += corr_np() * hist_load(corrhist_np[pos.side][BLACK][pos.nonpawn_hash(BLACK) % CORRHIST_SZ]);
+	corr += corr_maj() * hist_load(corrhist_maj[pos.side][pos.major_hash() % CORRHIST_SZ]);
+	corr += corr_min() * hist_load(corrhist_min[pos.side][pos.minor_hash() % CORRHIST_SZ]);
 	if (ply >= 2)
-		corr += corr_cont() * (line - 1)->corr_hist->hist[pos.side][(line - 2)->piece][(line - 2)->move.dst()];
+		corr += corr_cont() * hist_load((line - 1)->corr_hist->hist[pos.side][(line - 2)->piece][(line - 2)->move.dst()]);
 	if (ply >= 3)
-		corr += corr_cont2() * (line - 1)->corr_hist->hist[pos.side][(line - 3)->piece][(line - 3)->move.dst()];
-	corr += corr_threat() * corrhist_threat[pos.side][(pos.side_control[pos.side]) % THREAT_PRIME_MOD];
+		corr += corr_cont2() * hist_load((line - 1)->corr_hist->hist[pos.side][(line - 3)->piece][(line - 3)->move.dst()]);
+	corr += corr_threat() * hist_load(corrhist_threat[pos.side][(pos.side_control[pos.side]) % THREAT_PRIME_MOD]);
 
 	eval += corr / 2048;
 }
@@ -27,6 +27,19 @@
 #define THREAT_PRIME_MOD 16381
 #define PAWNHIST_SZ 1024
 
+/**
+ * History entries may be shared by several search threads (see HistoryTables), so they are only
+ * read and written through relaxed atomics. An update racing with another thread's can be lost,
+ * which costs nothing but a slightly noisier heuristic; on x86 these are plain 16-bit moves.
+ */
+inline Value hist_load(const Value &entry) {
+	return std::atomic_ref<Value>(const_cast<Value &>(entry)).load(std::memory_order_relaxed);
+}
+
+inline void hist_store(Value &entry, int val) {
+	std::atomic_ref<Value>(entry).store(val, std::memory_order_relaxed);
+}
+
 struct ContHistEntry {
 	Value hist[2][7][64]; // [side][piecetype][to]
 
@@ -117,3 +130,19 @@ struct Corrhist {
 	void update_corrhist(Position &pos, SSEntry *line, int ply, int bonus);
 	void apply_correction(Position &pos, SSEntry *line, int ply, Value &eval);
 };
+
+enum HistorySharing {
+	HIST_PER_THREAD, // Every thread has its own tables
+	HIST_PER_NODE, // One set of tables per NUMA node, shared by the threads running there
+	HIST_POOL, // One set of tables shared by the whole pool
+};
+
+/**
+ * The tables a search thread learns from while searching. They are kept apart from the rest of the
+ * ThreadInfo so that threads can share them; a thread reaches them through ThreadInfo::hist and
+ * ThreadInfo::corrhist, whichever set that is.
+ */
+struct HistoryTables {
+	alignas(64) History hist;
+	alignas(64) Corrhist corrhist;
+};
@@ -18,10 +18,12 @@
 
 #include "includes.hpp"
 
+#include <memory>
 #include <random>
 #include <sstream>
 #include <thread>
 
+#include "batch.hpp"
 #include "bitboard.hpp"
 #include "eval.hpp"
 #include "history.hpp"
@@ -30,14 +32,22 @@
 #include "threads.hpp"
 #include "ttable.hpp"
 
-#define MAX_TT (262144)
 #include "params.hpp"
 
 // Options
 size_t TT_SIZE = DEFAULT_TT_SIZE;
 bool quiet = false, dfrc_uci = false;
+PinPolicy pin_policy = PIN_NONE;
+std::string cpu_list;
 int move_overhead = 0;
 
+struct BenchResult {
+	uint64_t nodes = 0;
+	double time = 0; // Wall clock seconds spent searching
+
+	double nps() const { return time > 0 ? nodes / time : 0; }
+};
+
 uint64_t timemgmt(int64_t remtime, int64_t inc = 0) {
 	// Return time in ms that we can spend on this move
 	return std::max(1ll, (long long)(remtime * (tm_rem() / 100.0) + inc * (tm_inc() / 100.0)));
@@ -49,12 +59,33 @@ void run_uci() {
 	Position pos = Position();
 	RepetitionHandler rp;
 	rp.push_hash(pos.zobrist_without_ep());
+	// A `batch` runs on its own thread like a search, so that stop, quit and isready are still read
+	std::thread batch_thread;
+	std::unique_ptr<BatchControl> batch_control;
+	auto wait_batch = [&]() {
+		if (batch_thread.joinable())
+			batch_thread.join();
+	};
+	auto stop_batch = [&]() {
+		if (batch_control)
+			batch_control->stop();
+		wait_batch();
+	};
 	while (getline(std::cin, command)) {
 		if (command == "uci") {
 			std::cout << "id name PZChessBot " << VERSION << std::endl;
 			std::cout << "id author kevlu8 and wdotmathree" << std::endl;
 			std::cout << "option name Hash type spin default 16 min 1 max " << MAX_TT << std::endl;
+			std::cout << "option name TTNuma type combo default interleave var none var interleave var local" << std::endl;
+			std::cout << "option name TTShared type string default <empty>" << std::endl;
+			std::cout << "option name TTStatsInterval type spin default 0 min 0 max 60000" << std::endl;
 			std::cout << "option name Threads type spin default 1 min 1 max " << MAX_THREADS << std::endl;
+			std::cout << "option name ThreadVoting type check default true" << std::endl;
+			std::cout << "option name Ponder type check default false" << std::endl;
+			std::cout << "option name MultiPV type spin default 1 min 1 max 256" << std::endl;
+			std::cout << "option name HistorySharing type combo default thread var thread var node var pool" << std::endl;
+			std::cout << "option name CPUPinning type combo default none var none var physical var compact var list" << std::endl;
+			std::cout << "option name CPUList type string default <empty>" << std::endl;
 			std::cout << "option name Quiet type check default false" << std::endl;
 			std::cout << "option name Move Overhead type spin default 0 min 0 max 10000" << std::endl;
 			std::cout << "option name softnodes type check default false" << std::endl;
@@ -67,8 +98,10 @@ void run_uci() {
 			print_uci();
 			std::cout << "uciok" << std::endl;
 		} else if (command == "icu") {
+			stop_batch();
 			return; // exit uci mode
 		} else if (command == "isready") {
+			ttable.wait_clear();
 			std::cout << "readyok" << std::endl;
 		} else if (command.substr(0, 9) == "setoption") {
 			std::string optionname, optionvalue, token;
@@ -87,10 +120,37 @@ void run_uci() {
 					std::cerr << "Invalid hash size: " << optionint << std::endl;
 					continue;
 				}
-				TT_SIZE = MAX_TT;
-				while (TT_SIZE > optionint) TT_SIZE /= 2;
-				TT_SIZE *= 1024 * 1024 / sizeof(TTable::TTBucket);
+				if (ttable.shared()) {
+					ttable.resize(optionint * 1024 * 1024 / sizeof(TTable::TTBucket));
+					std::cout << "info string Hash is shared, " << optionint << " MB applies once TTShared is cleared" << std::endl;
+					continue;
+				}
+				TT_SIZE = optionint * 1024 * 1024 / sizeof(TTable::TTBucket);
 				ttable.resize(TT_SIZE);
+				std::cout << "info string Hash " << ttable.placement() << std::endl;
+			} else if (optionname == "TTNuma") {
+				if (optionvalue == "none") {
+					ttable.set_numa_policy(TT_NUMA_NONE);
+				} else if (optionvalue == "interleave") {
+					ttable.set_numa_policy(TT_NUMA_INTERLEAVE);
+				} else if (optionvalue == "local") {
+					ttable.set_numa_policy(TT_NUMA_LOCAL);
+				} else {
+					std::cerr << "Invalid TT NUMA policy: " << optionvalue << std::endl;
+					continue;
+				}
+				std::cout << "info string Hash " << ttable.placement() << std::endl;
+			} else if (optionname == "TTShared") {
+				if (optionvalue == "<empty>" || optionvalue == "") {
+					ttable.detach_shared();
+					TT_SIZE = ttable.TT_SIZE;
+				} else if (!ttable.attach_shared(optionvalue)) {
+					std::cout << "info string Failed to attach shared hash " << optionvalue << std::endl;
+					continue;
+				}
+				std::cout << "info string Hash " << ttable.placement() << std::endl;
+			} else if (optionname == "TTStatsInterval") {
+				tt_stats_interval = std::clamp(std::stoll(optionvalue), 0LL, 60000LL);
 			} else if (optionname == "Quiet") {
 				quiet = optionvalue == "true";
 			} else if (optionname == "Threads") {
@@ -100,7 +160,51 @@ void run_uci() {
 					num_threads = 1;
 				}
 				pool.resize(num_threads);
-				std::cout << "info string Using " << num_threads << " threads" << std::endl;
+				std::cout << "info string Using " << num_threads << " threads, " << pool.placement() << std::endl;
+				std::cout << "info string " << pool.history_desc() << std::endl;
+			} else if (optionname == "CPUPinning" || optionname == "CPUList") {
+				if (optionname == "CPUPinning") {
+					if (optionvalue == "none") {
+						pin_policy = PIN_NONE;
+					} else if (optionvalue == "physical") {
+						pin_policy = PIN_PHYSICAL;
+					} else if (optionvalue == "compact") {
+						pin_policy = PIN_COMPACT;
+					} else if (optionvalue == "list") {
+						pin_policy = PIN_LIST;
+					} else {
+						std::cerr << "Invalid CPU pinning policy: " << optionvalue << std::endl;
+						continue;
+					}
+				} else {
+					cpu_list = optionvalue == "<empty>" ? "" : optionvalue;
+					if (pin_policy != PIN_LIST)
+						continue; // Takes effect once the list policy is selected
+				}
+				if (!affinity.set_policy(pin_policy, cpu_list)) {
+					std::cout << "info string No usable CPUs for this pinning policy, keeping the previous one" << std::endl;
+					continue;
+				}
+				pool.repin();
+				std::cout << "info string " << affinity.describe() << std::endl;
+			} else if (optionname == "ThreadVoting") {
+				pool.voting = optionvalue == "true";
+			} else if (optionname == "MultiPV") {
+				multipv = std::clamp(std::stoi(optionvalue), 1, 256);
+			} else if (optionname == "Ponder") {
+				// Only tells the GUI that we accept `go ponder`, there is nothing to configure
+			} else if (optionname == "HistorySharing") {
+				if (optionvalue == "thread") {
+					pool.set_history_sharing(HIST_PER_THREAD);
+				} else if (optionvalue == "node") {
+					pool.set_history_sharing(HIST_PER_NODE);
+				} else if (optionvalue == "pool") {
+					pool.set_history_sharing(HIST_POOL);
+				} else {
+					std::cerr << "Invalid history sharing mode: " << optionvalue << std::endl;
+					continue;
+				}
+				std::cout << "info string " << pool.history_desc() << std::endl;
 			} else if (optionname == "Move") {
 				int overhead = std::stoi(optionvalue);
 				if (overhead < 0 || overhead > 10000) {
@@ -138,12 +242,13 @@ void run_uci() {
 				handle_set(optionname, optionvalue);
 			}
 		} else if (command == "ucinewgame") {
-			stop_search = true;
+			pool.interrupt();
 			pool.wait_finished();
+			stop_batch();
 			pos = Position();
 			rp.clear();
 			rp.push_hash(pos.zobrist_without_ep());
-			ttable.resize(TT_SIZE);
+			pool.clear_tt(); // Finishes in the background, the next search waits for whatever is left
 			pool.clear_search_vars();
 		} else if (command.substr(0, 8) == "position") {
 			// either `position startpos` or `position fen ...`
@@ -170,12 +275,71 @@ void run_uci() {
 				}
 			}
 		} else if (command == "quit") {
-			stop_search = true;
+			pool.interrupt();
 			pool.wait_finished();
+			stop_batch();
 			exit(0);
 		} else if (command == "stop") {
-			stop_search = true;
+			pool.interrupt();
+			pool.wait_finished();
+			stop_batch();
+		} else if (command == "ponderhit") {
+			pool.ponderhit();
+		} else if (command.substr(0, 6) == "batch ") {
+			// `batch <file> [nodes N] [depth D] [workers W] [hash MB]`, one worker per thread by default
+			pool.wait_finished();
+			wait_batch();
+			ttable.wait_clear();
+			std::stringstream args(command.substr(6));
+			std::string path;
+			args >> path;
+			BatchLimits limits;
+			limits.workers = pool.size();
+			parse_batch_limits(args, limits);
+			std::ifstream file(path);
+			if (!file) {
+				std::cout << "info string Failed to open " << path << std::endl;
+				continue;
+			}
+			batch_control = std::make_unique<BatchControl>();
+			batch_thread = std::thread([file = std::move(file), limits, control = batch_control.get()]() mutable {
+				auto start = std::chrono::steady_clock::now();
+				size_t done = run_batch(file, std::cout, limits, control);
+				double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				std::cout << "info string Analysed " << done << " positions in " << secs << " s" << std::endl;
+			});
+		} else if (command.substr(0, 9) == "savehash ") {
+			pool.wait_finished();
+			wait_batch();
+			std::string path = command.substr(9);
+			if (ttable.save(path))
+				std::cout << "info string Hash saved to " << path << std::endl;
+			else
+				std::cout << "info string Failed to save hash to " << path << std::endl;
+		} else if (command.substr(0, 9) == "loadhash ") {
 			pool.wait_finished();
+			wait_batch();
+			std::string path = command.substr(9);
+			if (ttable.load(path)) {
+				TT_SIZE = ttable.TT_SIZE;
+				std::cout << "info string Hash loaded from " << path << ", " << ttable.placement() << std::endl;
+			} else {
+				if (!ttable.shared())
+					TT_SIZE = ttable.TT_SIZE;
+				std::cout << "info string Failed to load hash from " << path << std::endl;
+			}
+		} else if (command == "ttstats") {
+			ttable.report_stats(std::cout);
+			uint64_t probes = 0, hits = 0;
+			for (size_t i = 0; i < pool.size(); i++) {
+				probes += pool.get_ti(i).eval_cache.probes.load(std::memory_order_relaxed);
+				hits += pool.get_ti(i).eval_cache.hits.load(std::memory_order_relaxed);
+			}
+			std::cout << "info string Eval cache probes " << probes << " hits " << hits << " (" << std::fixed << std::setprecision(1)
+					  << (probes ? 100.0 * hits / probes : 0.0) << "%)" << std::defaultfloat << std::endl;
+		} else if (command == "ttstats reset") {
+			ttable.reset_stats();
+			std::cout << "info string TT statistics reset" << std::endl;
 		} else if (command == "eval") {
 			std::array<Value, 8> score = debug_eval(pos);
 			pos.print_board();
@@ -190,6 +354,7 @@ void run_uci() {
 			}
 		} else if (command.substr(0, 2) == "go") {
 			pool.wait_finished();
+			wait_batch();
 			// `go wtime ... btime ... winc ... binc ...`
 			// only care about wtime and btime
 			std::stringstream ss(command);
@@ -197,7 +362,8 @@ void run_uci() {
 			int wtime = 0, btime = 0, winc = 0, binc = 0;
 			int depth = -1;
 			int nodes = -1;
-			bool inf = false;
+			bool inf = false, ponder = false, in_searchmoves = false;
+			std::vector<Move> searchmoves;
 			int movetime = -1;
 			int perft_depth = -1;
 			ss >> token;
@@ -214,12 +380,26 @@ void run_uci() {
 					ss >> depth;
 				} else if (token == "infinite") {
 					inf = true;
+				} else if (token == "ponder") {
+					ponder = true;
 				} else if (token == "nodes") {
 					ss >> nodes;
 				} else if (token == "movetime") {
 					ss >> movetime;
 				} else if (token == "perft") {
 					ss >> perft_depth;
+				} else if (token == "searchmoves") {
+					in_searchmoves = true;
+				} else if (in_searchmoves) {
+					// Tokens that aren't a legal move in this position are ignored
+					pzstd::vector<Move> moves;
+					pos.legal_moves(moves);
+					for (Move &move : moves) {
+						if (move.to_string() == token && pos.is_legal(move)) {
+							searchmoves.push_back(move);
+							break;
+						}
+					}
 				}
 			}
 			if (perft_depth != -1) {
@@ -249,21 +429,23 @@ void run_uci() {
 			timeleft = std::max(1, timeleft - move_overhead);
 
 			if (inf)
-				pool.search(pos, rp, 1e18, MAX_PLY, 1e18, quiet);
+				pool.search(pos, rp, 1e18, MAX_PLY, 1e18, quiet, ponder, searchmoves);
 			else if (depth != -1)
-				pool.search(pos, rp, 1e18, depth, 1e18, quiet);
+				pool.search(pos, rp, 1e18, depth, 1e18, quiet, ponder, searchmoves);
 			else if (nodes != -1)
-				pool.search(pos, rp, 1e18, MAX_PLY, nodes, quiet);
+				pool.search(pos, rp, 1e18, MAX_PLY, nodes, quiet, ponder, searchmoves);
 			else if (movetime != -1)
-				pool.search(pos, rp, movetime, MAX_PLY, 1e18, quiet);
+				pool.search(pos, rp, movetime, MAX_PLY, 1e18, quiet, ponder, searchmoves);
 			else
-				pool.search(pos, rp, timemgmt(timeleft, inc), MAX_PLY, 1e18, quiet);
+				pool.search(pos, rp, timemgmt(timeleft, inc), MAX_PLY, 1e18, quiet, ponder, searchmoves);
 		} else if (command == "wait") {
 			pool.wait_finished();
+			wait_batch();
 		}
 	}
-	stop_search = true;
+	pool.interrupt();
 	pool.wait_finished();
+	stop_batch();
 }
 
 int main(int argc, char *argv[]) {
@@ -321,26 +503,89 @@ int main(int argc, char *argv[]) {
 			"3br1k1/p1pn3p/1p3n2/5pNq/2P1p3/1PN3PP/P2Q1PB1/4R1K1 w - - 0 23",
 			"2r2b2/5p2/5k2/p1r1pP2/P2pB3/1P3P2/K1P3R1/7R w - - 23 93",
 		};
-		int bench_depth = 12;
-		if (argc == 3) {
-			// get bench depth
-			bench_depth = std::stoi(argv[2]);
+		/**
+		 * Searches every bench position to a fixed depth with the given number of threads and hash
+		 * size. Timing is wall clock, since CPU time grows with the number of threads, and the node
+		 * count is summed over all threads.
+		 */
+		auto run_bench = [&](int depth, size_t threads, size_t hash_mb, bool quiet) {
+			ttable.resize(hash_mb * 1024 * 1024 / sizeof(TTable::TTBucket), false);
+			Pool pool(threads);
+			Position pos = Position();
+			RepetitionHandler rp;
+			BenchResult res;
+			for (const auto &fen : bench_positions) {
+				pos.reset(fen);
+				rp.clear();
+				pool.clear_search_vars();
+				auto start = std::chrono::steady_clock::now();
+				pool.search(pos, rp, 1e9, depth, 1e18, quiet);
+				pool.wait_finished();
+				res.time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				for (size_t i = 0; i < threads; i++)
+					res.nodes += nodes[i].get();
+			}
+			return res;
+		};
+
+		if (argc >= 3 && std::string(argv[2]) == "scaling") {
+			// bench scaling [max threads] [depth] [hash]
+			size_t max_threads = argc >= 4 ? std::stoul(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+			int depth = argc >= 5 ? std::stoi(argv[4]) : 12;
+			size_t hash_mb = argc >= 6 ? std::stoul(argv[5]) : 16;
+			max_threads = std::clamp<size_t>(max_threads, 1, MAX_THREADS);
+
+			std::vector<BenchResult> results;
+			for (size_t t = 1; t <= max_threads; t++)
+				results.push_back(run_bench(depth, t, hash_mb, true));
+
+			std::cout << "\nthreads       nodes        nps   time (s)  ttd speedup  nps speedup  efficiency\n";
+			for (size_t t = 1; t <= max_threads; t++) {
+				const BenchResult &r = results[t - 1];
+				// Time-to-depth speedup is what SMP scaling actually buys; NPS speedup shows how much of
+				// the hardware was used
+				double ttd_speedup = results[0].time / r.time;
+				double nps_speedup = r.nps() / results[0].nps();
+				std::cout << std::setw(7) << t << std::setw(12) << r.nodes << std::setw(11) << (uint64_t)r.nps()
+						  << std::setw(11) << std::fixed << std::setprecision(3) << r.time
+						  << std::setw(13) << std::setprecision(2) << ttd_speedup << std::setw(13) << nps_speedup
+						  << std::setw(11) << std::setprecision(1) << 100 * ttd_speedup / t << "%" << std::endl;
+			}
+			return 0;
 		}
-		Pool pool;
-		Position pos = Position();
-		RepetitionHandler rp;
-		uint64_t tot_nodes = 0;
-		uint64_t start = clock();
-		for (const auto &fen : bench_positions) {
-			pos.reset(fen);
-			rp.clear();
-			pool.clear_search_vars();
-			pool.search(pos, rp, 1e9, bench_depth, 1e18, 0);
-			pool.wait_finished();
-			tot_nodes += nodes[0].get();
+
+		// bench [depth] [threads] [hash]
+		int bench_depth = argc >= 3 ? std::stoi(argv[2]) : 12;
+		size_t bench_threads = argc >= 4 ? std::clamp<size_t>(std::stoul(argv[3]), 1, MAX_THREADS) : 1;
+		size_t bench_hash = argc >= 5 ? std::stoul(argv[4]) : 16;
+		BenchResult res = run_bench(bench_depth, bench_threads, bench_hash, false);
+		std::cout << "Time to depth " << bench_depth << ": " << (int)(res.time * 1000) << " ms with " << bench_threads << " threads" << std::endl;
+		std::cout << res.nodes << " nodes " << (uint64_t)res.nps() << " nps" << std::endl;
+		return 0;
+	}
+	if (argc >= 3 && std::string(argv[1]) == "batch") {
+		// ./pzchessbot batch <file, or - for stdin> [nodes N] [depth D] [workers W] [hash MB]
+		BatchLimits limits;
+		limits.workers = std::max(1u, std::thread::hardware_concurrency());
+		std::stringstream args;
+		for (int i = 3; i < argc; i++)
+			args << argv[i] << ' ';
+		parse_batch_limits(args, limits);
+
+		std::string path = argv[2];
+		std::ifstream file;
+		if (path != "-") {
+			file.open(path);
+			if (!file) {
+				std::cerr << "Failed to open " << path << std::endl;
+				return 1;
+			}
 		}
-		uint64_t end = clock();
-		std::cout << tot_nodes << " nodes " << int(tot_nodes / ((double)(end - start) / CLOCKS_PER_SEC)) << " nps" << std::endl;
+		auto start = std::chrono::steady_clock::now();
+		size_t done = run_batch(path == "-" ? std::cin : file, std::cout, limits);
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		// Summary on stderr, so that stdout is only results
+		std::cerr << done << " positions in " << secs << " s, " << (uint64_t)(done / secs) << " positions/s" << std::endl;
 		return 0;
 	}
 	if (argc == 3 && std::string(argv[2]) == "quit") {
@@ -16,10 +16,15 @@
  * along with PZChessBot. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#pragma once
+
 #include <cerrno>
 #include <cstring>
 #include <exception>
+#include <fstream>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 #if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
@@ -28,10 +33,62 @@
 #include <sys/mman.h>
 #endif
 
-static void *large_alloc(size_t size) {
+#if defined(__linux__) && !defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26
+#endif
+
+enum PageKind {
+	PAGES_NORMAL,
+	PAGES_THP, // Normal mapping with transparent huge pages requested (the kernel may still use 4 KB pages)
+	PAGES_HUGE_2M, // Explicit 2 MB hugetlb pages
+	PAGES_HUGE_1G, // Explicit 1 GB hugetlb pages
+	PAGES_LARGE, // Windows large pages
+};
+
+/**
+ * Every allocation remembers the page size it actually got, so that it can be reported and so that
+ * `large_free` unmaps the rounded-up length that hugetlb mappings require.
+ */
+struct LargeAllocation {
+	size_t mapped;
+	PageKind kind;
+};
+
+inline std::mutex large_alloc_mtx;
+inline std::unordered_map<void *, LargeAllocation> large_allocs;
+
+#if defined(__linux__)
+/**
+ * Tries to map `size` bytes backed by explicit huge pages of 2^`shift` bytes. This only succeeds if
+ * the administrator has reserved enough of them (e.g. through /proc/sys/vm/nr_hugepages). Without
+ * MAP_NORESERVE the reservation happens here, so a too small pool fails now instead of crashing
+ * with SIGBUS when a page is first touched.
+ */
+inline void *hugetlb_alloc(size_t size, int shift, size_t &mapped) {
+	const size_t page = (size_t)1 << shift;
+	if (size < page / 2)
+		return nullptr; // Would waste more than half of the page
+	mapped = (size + page - 1) & ~(page - 1);
+	void *ptr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+	return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+// madvise(MADV_HUGEPAGE) succeeds even when THP is switched off system-wide, so check the setting directly
+inline bool thp_enabled() {
+	std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+	std::string setting;
+	return std::getline(file, setting) && setting.find("[never]") == std::string::npos;
+}
+#endif
+
+inline void *large_alloc(size_t size) {
+	size_t mapped = size;
+	PageKind kind = PAGES_NORMAL;
 #if defined(_WIN32)
 	void *ptr = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
-	if (ptr == nullptr) {
+	if (ptr != nullptr) {
+		kind = PAGES_LARGE;
+	} else {
 		ptr = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 		if (ptr == nullptr)
 			std::__throw_runtime_error(std::to_string(GetLastError()).c_str());
@@ -42,20 +99,40 @@ static void *large_alloc(size_t size) {
 		std::__throw_runtime_error(strerror(errno));
 	}
 #elif defined(__linux__)
-	void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-	if (ptr == MAP_FAILED) {
-		std::__throw_runtime_error(strerror(errno));
-	}
+	// Explicit huge pages first (largest that makes sense), then transparent huge pages, then normal pages
+	void *ptr;
+	if ((ptr = hugetlb_alloc(size, 30, mapped))) {
+		kind = PAGES_HUGE_1G;
+	} else if ((ptr = hugetlb_alloc(size, 21, mapped))) {
+		kind = PAGES_HUGE_2M;
+	} else {
+		mapped = size;
+		ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (ptr == MAP_FAILED) {
+			std::__throw_runtime_error(strerror(errno));
+		}
 
-	madvise(ptr, size, MADV_HUGEPAGE);
+		if (madvise(ptr, size, MADV_HUGEPAGE) == 0 && thp_enabled())
+			kind = PAGES_THP;
+	}
 #else
 #error Unsupported OS/kernel
 #endif
 
+	std::lock_guard lock(large_alloc_mtx);
+	large_allocs[ptr] = {mapped, kind};
 	return ptr;
 }
 
-static void large_free(void *ptr, size_t size) {
+inline void large_free(void *ptr, size_t size) {
+	{
+		std::lock_guard lock(large_alloc_mtx);
+		auto it = large_allocs.find(ptr);
+		if (it != large_allocs.end()) {
+			size = it->second.mapped;
+			large_allocs.erase(it);
+		}
+	}
 #if defined(_WIN32)
 	VirtualFree(ptr, 0, MEM_RELEASE);
 #elif defined(__APPLE__) || defined(__linux__)
@@ -64,3 +141,23 @@ static void large_free(void *ptr, size_t size) {
 #error Unsupported OS/kernel
 #endif
 }
+
+// Describes the pages backing a pointer returned by `large_alloc`, for UCI output
+inline std::string large_page_desc(void *ptr) {
+	std::lock_guard lock(large_alloc_mtx);
+	auto it = large_allocs.find(ptr);
+	if (it == large_allocs.end())
+		return "unknown pages";
+	switch (it->second.kind) {
+	case PAGES_HUGE_1G:
+		return "1 GB huge pages";
+	case PAGES_HUGE_2M:
+		return "2 MB huge pages";
+	case PAGES_THP:
+		return "transparent huge pages";
+	case PAGES_LARGE:
+		return "large pages";
+	default:
+		return "normal pages";
+	}
+}
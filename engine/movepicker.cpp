@@ -49,10 +49,26 @@ MovePicker::MovePicker(Position &pos, History *main_hist, bool skip_quiets) : po
 	stage = MP_QS_GEN;
 }
 
+MovePicker::MovePicker(Position &pos, const pzstd::vector<Move> &root_moves) : pos(pos), ss(nullptr), ply(0), main_hist(nullptr), end(0) {
+	stage = MP_ROOT_MOVES;
+	moves = root_moves;
+}
+
 Move MovePicker::next() {
 	if (stage == MP_STAGE_DONE)
 		return NullMove;
 
+	if (stage == MP_ROOT_MOVES) {
+		// The root moves are ordered by the previous iterations, see iterativedeepening
+		while (end < moves.size()) {
+			Move move = moves[end++];
+			if (!qskip || pos.is_capture(move) || move.type() == PROMOTION)
+				return move;
+		}
+		stage = MP_STAGE_DONE;
+		return NullMove;
+	}
+
 	if (stage == MP_STAGE_TT) {
 		stage = MP_STAGE_GEN;
 		if (ttMove != NullMove && pos.is_pseudolegal(ttMove))
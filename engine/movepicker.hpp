@@ -41,6 +41,8 @@ enum MP_Stage {
 	MP_QS_GEN,
 	MP_QS_MOVES,
 
+	MP_ROOT_MOVES,
+
 	MP_STAGE_DONE,
 };
 
@@ -61,6 +63,7 @@ public:
 	MovePicker(Position &pos, SSEntry *ss, int ply, History *main_hist, std::optional<TTable::TTEntry> &tentry);
 	MovePicker(Position &pos, History *main_hist, std::optional<TTable::TTEntry> &tentry); // Probcut constructor
 	MovePicker(Position &pos, History *main_hist, bool skip_quiets); // QSearch constructor
+	MovePicker(Position &pos, const pzstd::vector<Move> &root_moves); // Root constructor, keeps the given order
 
 	Move next();
 
@@ -18,29 +18,29 @@
 
 #include "accumulator.hpp"
 
-void AccumulatorManager::AccumulatorPair::update_add(Square sq, PieceType pt, bool side, int wbucket, int bbucket) {
+void AccumulatorManager::AccumulatorPair::update_add(const Network &net, Square sq, PieceType pt, bool side, int wbucket, int bbucket) {
 	uint16_t w_index = calculate_index(sq, pt, side, 0, wbucket);
 	uint16_t b_index = calculate_index(sq, pt, side, 1, bbucket);
 	for (int i = 0; i < L1_SIZE; i++) {
-		w_acc.val[i] += nnue_network.accumulator_weights[w_index][i];
-		b_acc.val[i] += nnue_network.accumulator_weights[b_index][i];
+		w_acc.val[i] += net.accumulator_weights[w_index][i];
+		b_acc.val[i] += net.accumulator_weights[b_index][i];
 	}
 }
 
-void AccumulatorManager::AccumulatorPair::update_sub(Square sq, PieceType pt, bool side, int wbucket, int bbucket) {
+void AccumulatorManager::AccumulatorPair::update_sub(const Network &net, Square sq, PieceType pt, bool side, int wbucket, int bbucket) {
 	uint16_t w_index = calculate_index(sq, pt, side, 0, wbucket);
 	uint16_t b_index = calculate_index(sq, pt, side, 1, bbucket);
 	for (int i = 0; i < L1_SIZE; i++) {
-		w_acc.val[i] -= nnue_network.accumulator_weights[w_index][i];
-		b_acc.val[i] -= nnue_network.accumulator_weights[b_index][i];
+		w_acc.val[i] -= net.accumulator_weights[w_index][i];
+		b_acc.val[i] -= net.accumulator_weights[b_index][i];
 	}
 }
 
 void AccumulatorManager::full_refresh(Position &pos, int index) {
 	// Init the first accumulator so we have a basepoint
 	for (int i = 0; i < L1_SIZE; i++) {
-		accs[index].w_acc.val[i] = nnue_network.accumulator_biases[i];
-		accs[index].b_acc.val[i] = nnue_network.accumulator_biases[i];
+		accs[index].w_acc.val[i] = net->accumulator_biases[i];
+		accs[index].b_acc.val[i] = net->accumulator_biases[i];
 	}
 
 	Square wkingsq = (Square)arch::tzcnt(pos.piece_boards[KING] & pos.piece_boards[OCC(WHITE)]);
@@ -57,7 +57,7 @@ void AccumulatorManager::full_refresh(Position &pos, int index) {
 
 		if (piece != NO_PIECE) {
 			// Add to accumulator
-			accs[index].update_add((Square)i, pt, side, winbucket, binbucket);
+			accs[index].update_add(*net, (Square)i, pt, side, winbucket, binbucket);
 		}
 	}
 
@@ -89,7 +89,7 @@ void AccumulatorManager::refresh_finny(Position &pos, int index) {
 				// Add to accumulator
 				int index = calculate_index((Square)i, pt, side, 0, winbucket);
 				for (int k = 0; k < L1_SIZE; k++) {
-					f_w_acc.val[k] += nnue_network.accumulator_weights[index][k];
+					f_w_acc.val[k] += net->accumulator_weights[index][k];
 				}
 			}
 
@@ -97,7 +97,7 @@ void AccumulatorManager::refresh_finny(Position &pos, int index) {
 				// Remove from accumulator
 				int index = calculate_index((Square)i, prev_w_pt, prev_w_side, 0, winbucket);
 				for (int k = 0; k < L1_SIZE; k++) {
-					f_w_acc.val[k] -= nnue_network.accumulator_weights[index][k];
+					f_w_acc.val[k] -= net->accumulator_weights[index][k];
 				}
 			}
 		}
@@ -111,7 +111,7 @@ void AccumulatorManager::refresh_finny(Position &pos, int index) {
 				// Add to accumulator
 				int index = calculate_index((Square)i, pt, side, 1, binbucket);
 				for (int k = 0; k < L1_SIZE; k++) {
-					f_b_acc.val[k] += nnue_network.accumulator_weights[index][k];
+					f_b_acc.val[k] += net->accumulator_weights[index][k];
 				}
 			}
 
@@ -119,7 +119,7 @@ void AccumulatorManager::refresh_finny(Position &pos, int index) {
 				// Remove from accumulator
 				int index = calculate_index((Square)i, prev_b_pt, prev_b_side, 1, binbucket);
 				for (int k = 0; k < L1_SIZE; k++) {
-					f_b_acc.val[k] -= nnue_network.accumulator_weights[index][k];
+					f_b_acc.val[k] -= net->accumulator_weights[index][k];
 				}
 			}
 		}
@@ -140,6 +140,40 @@ void AccumulatorManager::refresh_finny(Position &pos, int index) {
 	accs[index].correct = true;
 }
 
+/**
+ * Computes one perspective of accumulator i from accumulator i-1, using the deltas queued by
+ * make_move. The weight rows are restrict-qualified: since the network is reached through a pointer,
+ * GCC can't otherwise rule out the rows overlapping the output and leaves the 3- and 4-delta loops
+ * unvectorized.
+ */
+static inline void apply_update(int16_t *__restrict out, const int16_t *__restrict in, const Network &net, const int *deltas, int n) {
+	if (n == 2) {
+		// -+
+		const int16_t *__restrict s0 = net.accumulator_weights[deltas[0]];
+		const int16_t *__restrict a0 = net.accumulator_weights[deltas[1]];
+		for (int k = 0; k < L1_SIZE; k++) {
+			out[k] = in[k] - s0[k] + a0[k];
+		}
+	} else if (n == 3) {
+		// --+
+		const int16_t *__restrict s0 = net.accumulator_weights[deltas[0]];
+		const int16_t *__restrict s1 = net.accumulator_weights[deltas[1]];
+		const int16_t *__restrict a0 = net.accumulator_weights[deltas[2]];
+		for (int k = 0; k < L1_SIZE; k++) {
+			out[k] = in[k] - s0[k] - s1[k] + a0[k];
+		}
+	} else if (n == 4) {
+		// --++
+		const int16_t *__restrict s0 = net.accumulator_weights[deltas[0]];
+		const int16_t *__restrict s1 = net.accumulator_weights[deltas[1]];
+		const int16_t *__restrict a0 = net.accumulator_weights[deltas[2]];
+		const int16_t *__restrict a1 = net.accumulator_weights[deltas[3]];
+		for (int k = 0; k < L1_SIZE; k++) {
+			out[k] = in[k] - s0[k] - s1[k] + a0[k] + a1[k];
+		}
+	}
+}
+
 void AccumulatorManager::apply_lazy(Position &pos) {
 	if (current().correct) return; // No updates needed
 	int index = idx, last_same_bucket = idx;
@@ -170,25 +204,8 @@ void AccumulatorManager::apply_lazy(Position &pos) {
 
 	for (int i = index + 1; i <= idx; i++) {
 		auto &u = updates[i];
-		if (u.deltas == 2) {
-			// -+
-			for (int k = 0; k < L1_SIZE; k++) {
-				accs[i].w_acc.val[k] = accs[i-1].w_acc.val[k] - nnue_network.accumulator_weights[u.w_deltas[0]][k] + nnue_network.accumulator_weights[u.w_deltas[1]][k];
-				accs[i].b_acc.val[k] = accs[i-1].b_acc.val[k] - nnue_network.accumulator_weights[u.b_deltas[0]][k] + nnue_network.accumulator_weights[u.b_deltas[1]][k];
-			}
-		} else if (u.deltas == 3) {
-			// --+
-			for (int k = 0; k < L1_SIZE; k++) {
-				accs[i].w_acc.val[k] = accs[i-1].w_acc.val[k] - nnue_network.accumulator_weights[u.w_deltas[0]][k] - nnue_network.accumulator_weights[u.w_deltas[1]][k] + nnue_network.accumulator_weights[u.w_deltas[2]][k];
-				accs[i].b_acc.val[k] = accs[i-1].b_acc.val[k] - nnue_network.accumulator_weights[u.b_deltas[0]][k] - nnue_network.accumulator_weights[u.b_deltas[1]][k] + nnue_network.accumulator_weights[u.b_deltas[2]][k];
-			}
-		} else if (u.deltas == 4) {
-			// --++
-			for (int k = 0; k < L1_SIZE; k++) {
-				accs[i].w_acc.val[k] = accs[i-1].w_acc.val[k] - nnue_network.accumulator_weights[u.w_deltas[0]][k] - nnue_network.accumulator_weights[u.w_deltas[1]][k] + nnue_network.accumulator_weights[u.w_deltas[2]][k] + nnue_network.accumulator_weights[u.w_deltas[3]][k];
-				accs[i].b_acc.val[k] = accs[i-1].b_acc.val[k] - nnue_network.accumulator_weights[u.b_deltas[0]][k] - nnue_network.accumulator_weights[u.b_deltas[1]][k] + nnue_network.accumulator_weights[u.b_deltas[2]][k] + nnue_network.accumulator_weights[u.b_deltas[3]][k];
-			}
-		}
+		apply_update(accs[i].w_acc.val, accs[i-1].w_acc.val, *net, u.w_deltas, u.deltas);
+		apply_update(accs[i].b_acc.val, accs[i-1].b_acc.val, *net, u.b_deltas, u.deltas);
 		accs[i].correct = true;
 	}
 }
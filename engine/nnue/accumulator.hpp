@@ -28,8 +28,8 @@ struct AccumulatorManager {
 		Accumulator w_acc, b_acc;
 		bool correct = false;
 
-		void update_add(Square sq, PieceType pt, bool side, int wbucket, int bbucket);
-		void update_sub(Square sq, PieceType pt, bool side, int wbucket, int bbucket);
+		void update_add(const Network &net, Square sq, PieceType pt, bool side, int wbucket, int bbucket);
+		void update_sub(const Network &net, Square sq, PieceType pt, bool side, int wbucket, int bbucket);
 	};
 
 	struct Update {
@@ -49,6 +49,7 @@ struct AccumulatorManager {
 		Cache() {
 			std::fill(&mailboxes[0][0][0], &mailboxes[0][0][0] + NINPUTS * 2 * 2 * 64, NO_PIECE);
 
+			// The biases are the same in every replica of the network, so the global copy is fine here
 			for (int i = 0; i < NINPUTS * 2; i++) {
 				for (int j = 0; j < L1_SIZE; j++) {
 					accs[i].w_acc.val[j] = nnue_network.accumulator_biases[j];
@@ -58,6 +59,7 @@ struct AccumulatorManager {
 		}
 	};
 
+	const Network *net = &nnue_network; // The replica on this thread's NUMA node, see local_network
 	AccumulatorPair accs[MAX_PLY + 5];
 	int idx = 0;
 	Update updates[MAX_PLY + 5]; // Stores the changed indices for each move - updates[i] stores the changes from accs[i-1] to accs[i]
@@ -24,19 +24,19 @@
 #define MOVENUM(x) ((((#x)[1] - '1') << 12) | (((#x)[0] - 'a') << 8) | (((#x)[3] - '1') << 4) | ((#x)[2] - 'a'))
 
 uint64_t mx_nodes = 1e18; // Maximum nodes to search
-bool stop_search = true;
+std::atomic<bool> stop_search = true;
+std::atomic<bool> pondering = false; // Searching on the opponent's time: never stop on our own, see Pool::ponderhit
 std::chrono::steady_clock::time_point start;
 uint64_t mxtime = 1e18; // Maximum time to search in milliseconds
+int multipv = 1; // Number of best lines to search and report
 bool minimal = false, show_wdl = false, do_softnodes = false, do_datagen = false;
-std::stringstream last_line;
+int64_t tt_stats_interval = 0; // Milliseconds between TT statistics lines during search, 0 to disable
 
 uint16_t num_threads = 1;
 
-std::atomic<uint64_t> nodecnt[64][64] = {{}};
 NodeCounter nodes[MAX_THREADS];
 std::atomic<uint64_t> tbhits = 0;
 
-std::unordered_set<uint16_t> tb_moves;
 
 uint64_t perft(Position &pos, int depth) {
 	if (depth == 0)
@@ -162,24 +162,15 @@ Value hist_bonus(int depth, int quad, int lin, int const_val) {
 }
 
 /**
- * Get the usage of the transposition table
- *
- * Used for UCI output. This function samples the first 1024 entries of the TTable
- * then counts how many are occupied.
+ * Static evaluation from the side to move's point of view, going through the thread's eval cache
  */
-double get_ttable_sz() {
-	int cnt = 0;
-	for (int i = 0; i < 1024; i++) {
-		if (i >= ttable.TT_SIZE)
-			break;
-		if (ttable.TT[i].entries[0].valid() && ttable.TT[i].entries[0].age() == ttable.age)
-			cnt++;
-		if (ttable.TT[i].entries[1].valid() && ttable.TT[i].entries[1].age() == ttable.age)
-			cnt++;
-		if (ttable.TT[i].entries[2].valid() && ttable.TT[i].entries[2].age() == ttable.age)
-			cnt++;
-	}
-	return cnt / (3.0 * 1024);
+Value cached_eval(Position &pos, ThreadInfo &ti) {
+	const uint64_t key = EvalCache::key(pos);
+	if (auto cached = ti.eval_cache.probe(key))
+		return *cached;
+	const Value score = eval(pos, ti.am);
+	ti.eval_cache.store(key, score);
+	return score;
 }
 
 /**
@@ -225,46 +216,49 @@ bool is_valid_score(Value score) {
  * - Late move reduction (instead of reducing depth, we reduce the search window) (not a known technique, maybe worth trying?)
  */
 Value quiesce(Position &pos, ThreadInfo &ti, SSEntry *ss, Value alpha, Value beta, int side, int ply, bool pv = false) {
-	nodes[ti.id]++;
+	if (!(++ti.nodecnt & 1023))
+		nodes[ti.id] = ti.nodecnt;
 
 	if (pv)
 		ti.pvlen[ply] = 0;
 
-	if (stop_search)
+	if (*ti.stop)
 		return 0;
 
 	if (ti.is_main) {
-		auto cur_nodes = nodes[ti.id].get();
-		if (!(cur_nodes & 1023)) {
-			// The time check is relatively expensive and thus only performed every 1024 nodes
-			auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
-			if (time > mxtime) {
-				stop_search = true;
-				return 0;
-			}
-		}
-
+		// The time limit is enforced by the pool's timer thread, only the node limit is checked here
+		auto cur_nodes = ti.nodecnt;
 		if (!do_softnodes && cur_nodes > mx_nodes) {
-			stop_search = true;
+			*ti.stop = true;
 			return 0;
 		} else if (do_softnodes && mx_nodes < 1e15 && cur_nodes > mx_nodes * 50) {
-			stop_search = true;
+			*ti.stop = true;
 			return 0;
 		}
+	} else if (ti.nodecnt > ti.max_nodes) {
+		*ti.stop = true;
+		return 0;
 	}
 
 	RepetitionHandler &rp = ti.rp;
 
 	// Threefold or 50 move rule
-	if (rp.threefold(ply, pos.zobrist_without_ep()) || pos.halfmove >= 100 || pos.insufficient_material()) {
+	if (rp.threefold(ply, pos.zobrist_without_ep(), pos.repetition_window()) || pos.halfmove >= 100 || pos.insufficient_material()) {
 		return 0;
 	}
 
+	// We can force a repetition, see negamax
+	if (alpha < 0 && rp.upcoming_repetition(pos, ply)) {
+		alpha = 0;
+		if (alpha >= beta)
+			return alpha;
+	}
+
 	if (ply >= MAX_PLY)
 		return eval(pos, ti.am) * side; // Just in case
 
 	// Check for TTable cutoff
-	auto tentry = ttable.probe(pos.zobrist);
+	auto tentry = ti.tt->probe(pos.zobrist);
 	Value tteval = -VALUE_INFINITE;
 	if (tentry && is_valid_score(tentry->eval))
 		tteval = tt_to_score(tentry->eval, ply);
@@ -287,13 +281,11 @@ Value quiesce(Position &pos, ThreadInfo &ti, SSEntry *ss, Value alpha, Value bet
 	Value stand_pat = -VALUE_INFINITE;
 	Value raw_eval = -VALUE_INFINITE;
 	if (!in_check) {
-		stand_pat = tentry && is_valid_score(tentry->s_eval) ? tentry->s_eval : eval(pos, ti.am) * side;
+		stand_pat = tentry && is_valid_score(tentry->s_eval) ? tentry->s_eval : cached_eval(pos, ti) * side;
 		raw_eval = stand_pat;
-		ti.thread_corrhist.apply_correction(pos, ss, ply, stand_pat);
+		ti.corrhist->apply_correction(pos, ss, ply, stand_pat);
 		if (tentry && is_valid_score(tteval) && abs(tteval) < VALUE_WIN && tentry->bound() != (tteval > stand_pat ? UPPER_BOUND : LOWER_BOUND))
 			stand_pat = tteval;
-		if (!tentry)
-			ttable.store(pos.zobrist, -VALUE_INFINITE, raw_eval, 0, NONE, false, NullMove);
 	}
 
 	// If we are too good, return the score
@@ -302,7 +294,7 @@ Value quiesce(Position &pos, ThreadInfo &ti, SSEntry *ss, Value alpha, Value bet
 	if (stand_pat > alpha)
 		alpha = stand_pat;
 
-	MovePicker mp(pos, &ti.thread_hist, !in_check);
+	MovePicker mp(pos, ti.hist, !in_check);
 
 	Value best = stand_pat;
 	Move best_move = NullMove;
@@ -349,15 +341,15 @@ Value quiesce(Position &pos, ThreadInfo &ti, SSEntry *ss, Value alpha, Value bet
 		ss->move = move;
 		ss->captured = (PieceType)(pos.mailbox[move.dst()] & 7);
 		ss->piece = (PieceType)(pos.mailbox[move.src()] & 7);
-		ss->cont_hist = &ti.thread_hist.cont_hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
-		ss->corr_hist = &ti.thread_corrhist.corrhist_cont[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		ss->cont_hist = &ti.hist->cont_hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		ss->corr_hist = &ti.corrhist->corrhist_cont[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
 
 		Position pos_after = pos;
 		pos_after.make_move(move);
 		rp.push_hash(pos_after.zobrist_without_ep());
 		ti.am.make_move(pos, move, pos_after);
 
-		arch::prefetch(&ttable.TT[pos_after.zobrist & (ttable.TT_SIZE - 1)]);
+		ti.tt->prefetch(pos_after.zobrist);
 		Value score = -quiesce(pos_after, ti, ss + 1, -beta, -alpha, -side, ply + 1, pv);
 
 		ti.am.pop_move();
@@ -369,7 +361,7 @@ Value quiesce(Position &pos, ThreadInfo &ti, SSEntry *ss, Value alpha, Value bet
 		ss->cont_hist = nullptr;
 		ss->corr_hist = nullptr;
 
-		if (stop_search)
+		if (*ti.stop)
 			return 0;
 
 		if (score > best) {
@@ -402,7 +394,7 @@ Value quiesce(Position &pos, ThreadInfo &ti, SSEntry *ss, Value alpha, Value bet
 	}
 
 	Move tt_move = best_move != NullMove ? best_move : (tentry ? tentry->best_move : NullMove);
-	ttable.store(pos.zobrist, score_to_tt(best, ply), raw_eval, 0, ttf, pv, tt_move);
+	ti.tt->store(pos.zobrist, score_to_tt(best, ply), raw_eval, 0, ttf, pv, tt_move);
 
 	return best;
 }
@@ -419,29 +411,25 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 		ti.seldepth = std::max(ti.seldepth, ply);
 	}
 
-	nodes[ti.id]++;
+	if (!(++ti.nodecnt & 1023))
+		nodes[ti.id] = ti.nodecnt;
 
-	if (stop_search)
+	if (*ti.stop)
 		return 0;
 
 	if (ti.is_main) {
-		auto cur_nodes = nodes[ti.id].get();
-		if (!(cur_nodes & 1023)) {
-			// The time check is relatively expensive and thus only performed every 1024 nodes
-			auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
-			if (time > mxtime) {
-				stop_search = true;
-				return 0;
-			}
-		}
-
+		// The time limit is enforced by the pool's timer thread, only the node limit is checked here
+		auto cur_nodes = ti.nodecnt;
 		if (!do_softnodes && cur_nodes > mx_nodes) {
-			stop_search = true;
+			*ti.stop = true;
 			return 0;
 		} else if (do_softnodes && mx_nodes < 1e15 && cur_nodes > mx_nodes * 50) {
-			stop_search = true;
+			*ti.stop = true;
 			return 0;
 		}
+	} else if (ti.nodecnt > ti.max_nodes) {
+		*ti.stop = true;
+		return 0;
 	}
 
 	/**
@@ -460,7 +448,7 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 	bool in_check = pos.checkers[pos.side];
 
 	// Threefold or 50 move rule
-	if (!root && (rp.threefold(ply, pos.zobrist_without_ep()) || pos.halfmove >= 100 || pos.insufficient_material())) {
+	if (!root && (rp.threefold(ply, pos.zobrist_without_ep(), pos.repetition_window()) || pos.halfmove >= 100 || pos.insufficient_material())) {
 		if (pos.halfmove >= 100 && in_check) {
 			// special case: if we are in checkmate on the 50-move rule, it's actually a loss
 			// must do an extra check for mate
@@ -484,6 +472,19 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 		return quiesce(pos, ti, ss, alpha, beta, side, ply, pv);
 	}
 
+	/**
+	 * Upcoming repetition detection
+	 *
+	 * If we can move back into a position we have already been in, we can force at least a draw
+	 * even before the repetition happens, so a draw is a lower bound on our score. Quiescence search
+	 * does the same check, so it is only done here once we know we aren't dropping into it.
+	 */
+	if (!root && alpha < 0 && rp.upcoming_repetition(pos, ply)) {
+		alpha = 0;
+		if (alpha >= beta)
+			return alpha;
+	}
+
 	bool ttpv = pv;
 	bool excluded = ss->excl != NullMove;
 
@@ -496,7 +497,7 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 	 * Note that we cannot do this in singular search (`ss->excl != NullMove`)
 	 * because the singular search excludes a move that may be the best move in the position.
 	 */
-	auto tentry = ttable.probe(pos.zobrist);
+	auto tentry = ti.tt->probe(pos.zobrist);
 	Value tteval = -VALUE_INFINITE;
 	bool ttcapt = false;
 	if (tentry && is_valid_score(tentry->eval))
@@ -541,7 +542,7 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 				tb_bound = UPPER_BOUND;
 
 			if (tb_bound == EXACT || (tb_bound == LOWER_BOUND && tb_score >= beta) || (tb_bound == UPPER_BOUND && tb_score <= alpha)) {
-				ttable.store(pos.zobrist, score_to_tt(tb_score, ply), VALUE_NONE, depth, tb_bound, ttpv, NullMove);
+				ti.tt->store(pos.zobrist, score_to_tt(tb_score, ply), VALUE_NONE, depth, tb_bound, ttpv, NullMove);
 				return tb_score;
 			}
 		}
@@ -553,16 +554,14 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 	Value tt_corr_eval = 0;
 	Value corr_val = 0;
 	if (!in_check) {
-		cur_eval = tentry && is_valid_score(tentry->s_eval) ? tentry->s_eval : eval(pos, ti.am) * side;
+		cur_eval = tentry && is_valid_score(tentry->s_eval) ? tentry->s_eval : cached_eval(pos, ti) * side;
 		raw_eval = cur_eval;
 		if (!excluded)
-			ti.thread_corrhist.apply_correction(pos, ss, ply, cur_eval);
+			ti.corrhist->apply_correction(pos, ss, ply, cur_eval);
 		corr_val = abs(cur_eval - raw_eval);
 		tt_corr_eval = cur_eval;
 		if (tentry && is_valid_score(tteval) && abs(tteval) < VALUE_WIN && tentry->bound() != (tteval > cur_eval ? UPPER_BOUND : LOWER_BOUND))
 			tt_corr_eval = tteval;
-		else if (!tentry)
-			ttable.store(pos.zobrist, -VALUE_INFINITE, raw_eval, 0, NONE, false, NullMove);
 	}
 
 	ss->eval = in_check ? VALUE_NONE : cur_eval; // If in check, we don't have a valid eval yet
@@ -605,8 +604,8 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 		 * really no good way of preventing this except for disabling NMP in positions where there
 		 * are probably Zugzwangs (e.g. endgames).
 		 */
-		ss->cont_hist = &ti.thread_hist.cont_hist[pos.side][0][0];
-		ss->corr_hist = &ti.thread_corrhist.corrhist_cont[pos.side][0][0];
+		ss->cont_hist = &ti.hist->cont_hist[pos.side][0][0];
+		ss->corr_hist = &ti.corrhist->corrhist_cont[pos.side][0][0];
 
 		Position pos_after = pos;
 		pos_after.make_move(NullMove);
@@ -668,7 +667,7 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 		 * or not the move could cut. If the QSearch doesn't fail high, we skip the move
 		 * in order to save effort.
 		 */
-		MovePicker pcpicker(pos, &ti.thread_hist, tentry);
+		MovePicker pcpicker(pos, ti.hist, tentry);
 		Move pc_move = NullMove;
 		int pc_depth = depth - 5;
 		Value pc_beta = beta + probcut_margin();
@@ -679,15 +678,15 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 			ss->move = pc_move;
 			ss->captured = (PieceType)(pos.mailbox[pc_move.dst()] & 7);
 			ss->piece = (PieceType)(pos.mailbox[pc_move.src()] & 7);
-			ss->cont_hist = &ti.thread_hist.cont_hist[pos.side][pos.mailbox[pc_move.src()] & 7][pc_move.dst()];
-			ss->corr_hist = &ti.thread_corrhist.corrhist_cont[pos.side][pos.mailbox[pc_move.src()] & 7][pc_move.dst()];
+			ss->cont_hist = &ti.hist->cont_hist[pos.side][pos.mailbox[pc_move.src()] & 7][pc_move.dst()];
+			ss->corr_hist = &ti.corrhist->corrhist_cont[pos.side][pos.mailbox[pc_move.src()] & 7][pc_move.dst()];
 
 			Position pos_after = pos;
 			pos_after.make_move(pc_move);
 			rp.push_hash(pos_after.zobrist_without_ep());
 			ti.am.make_move(pos, pc_move, pos_after);
 
-			arch::prefetch(&ttable.TT[pos_after.zobrist & (ttable.TT_SIZE - 1)]);
+			ti.tt->prefetch(pos_after.zobrist);
 			Value score = -quiesce(pos_after, ti, ss + 1, -pc_beta, -pc_beta + 1, -side, ply + 1);
 
 			if (score >= pc_beta)
@@ -702,11 +701,11 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 			ss->cont_hist = nullptr;
 			ss->corr_hist = nullptr;
 
-			if (stop_search)
+			if (*ti.stop)
 				return 0;
 
 			if (score >= pc_beta) {
-				ttable.store(pos.zobrist, score_to_tt(score, ply), raw_eval, pc_depth + 1, LOWER_BOUND, false, pc_move);
+				ti.tt->store(pos.zobrist, score_to_tt(score, ply), raw_eval, pc_depth + 1, LOWER_BOUND, false, pc_move);
 				return score;
 			}
 		}
@@ -714,7 +713,12 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 
 	Value best = -VALUE_INFINITE;
 
-	MovePicker mp(pos, ss, ply, &ti.thread_hist, tentry);
+	pzstd::vector<Move> root_order;
+	if (root) {
+		for (const RootMove &rm : ti.root_list)
+			root_order.push_back(rm.move);
+	}
+	MovePicker mp = root ? MovePicker(pos, root_order) : MovePicker(pos, ss, ply, ti.hist, tentry);
 
 	// Internal iterative reductions
 	if ((pv || cutnode) && depth > 4 && !(tentry && tentry->best_move != NullMove)) {
@@ -738,7 +742,7 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 
 	uint64_t prev_nodes = 0;
 	if (root)
-		prev_nodes = nodes[ti.id].get();
+		prev_nodes = ti.nodecnt;
 
 	(ss + 1)->cutoffcnt = 0;
 
@@ -746,8 +750,8 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 		if (move == ss->excl || !pos.is_legal(move))
 			continue;
 
-		if (root && !tb_moves.empty() && !tb_moves.count(move.data))
-			continue; // If the current move isn't included in the viable TB moves, skip
+		if (root && std::find(ti.root_excluded.begin(), ti.root_excluded.end(), move) != ti.root_excluded.end())
+			continue; // Already ranked by an earlier MultiPV pass
 
 		bool capt = pos.is_capture(move);
 		bool promo = (move.type() == PROMOTION);
@@ -821,7 +825,7 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 			extension--;
 		}
 
-		int hist = capt ? ti.thread_hist.get_capthist(pos, move) : ti.thread_hist.get_history(pos, move, ply, ss);
+		int hist = capt ? ti.hist->get_capthist(pos, move) : ti.hist->get_history(pos, move, ply, ss);
 		if (best > -VALUE_WIN) {
 			int lmrdepth = std::clamp(depth - 1 - reduction[i][depth] / 1024, 1, MAX_PLY);
 			if (i >= (3 + depth * depth) / (2 - improving)) {
@@ -873,15 +877,15 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 		ss->move = move;
 		ss->captured = (PieceType)(pos.mailbox[move.dst()] & 7);
 		ss->piece = (PieceType)(pos.mailbox[move.src()] & 7);
-		ss->cont_hist = &ti.thread_hist.cont_hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
-		ss->corr_hist = &ti.thread_corrhist.corrhist_cont[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		ss->cont_hist = &ti.hist->cont_hist[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
+		ss->corr_hist = &ti.corrhist->corrhist_cont[pos.side][pos.mailbox[move.src()] & 7][move.dst()];
 
 		Position pos_after = pos;
 		pos_after.make_move(move);
 		rp.push_hash(pos_after.zobrist_without_ep());
 		ti.am.make_move(pos, move, pos_after);
 
-		arch::prefetch(&ttable.TT[pos_after.zobrist & (ttable.TT_SIZE - 1)]);
+		ti.tt->prefetch(pos_after.zobrist);
 
 		int newdepth = depth - 1 + extension;
 
@@ -948,9 +952,9 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 				if (searched_depth < newdepth) {
 					score = -negamax<false>(pos_after, ti, ss + 1, newdepth, -alpha - 1, -alpha, -side, !cutnode, ply + 1);
 
-					if (!capt && !promo && (score <= alpha || score >= beta) && !stop_search) {
+					if (!capt && !promo && (score <= alpha || score >= beta) && !*ti.stop) {
 						const int bonus = score >= beta ? hist_bonus(newdepth, postlmr_quad(), postlmr_lin(), postlmr_const()) : -hist_bonus(newdepth, postlmr_quad(), postlmr_lin(), postlmr_const());
-						ti.thread_hist.update_conthist(pos, move, ply, ss, bonus);
+						ti.hist->update_conthist(pos, move, ply, ss, bonus);
 					}
 				}
 			}
@@ -974,13 +978,22 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 		ss->cont_hist = nullptr;
 		ss->corr_hist = nullptr;
 
-		if (stop_search)
+		if (*ti.stop)
 			return 0;
 
 		if (root) {
-			auto cur_nodes = nodes[ti.id].get();
-			nodecnt[move.src()][move.dst()].fetch_add(cur_nodes - prev_nodes, std::memory_order_relaxed);
-			prev_nodes = cur_nodes;
+			RootMove &rm = *std::find_if(ti.root_list.begin(), ti.root_list.end(), [&](const RootMove &r) { return r.move == move; });
+			rm.nodes += ti.nodecnt - prev_nodes;
+			prev_nodes = ti.nodecnt;
+
+			if (i == 0 || score > alpha) {
+				rm.score = score;
+				rm.pv[0] = move;
+				rm.pvlen = ti.pvlen[ply + 1] + 1;
+				std::copy(ti.pvtable[ply + 1], ti.pvtable[ply + 1] + ti.pvlen[ply + 1], rm.pv + 1);
+			} else {
+				rm.score = -VALUE_INFINITE; // Only an upper bound, which would mess up the ordering
+			}
 		}
 
 		if (score <= alpha) {
@@ -1020,15 +1033,15 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 			int hist_depth = depth + (score >= beta + hist_large_margin());
 			const int bonus = hist_bonus(hist_depth, hist_quad(), hist_lin(), hist_const());
 			if (!capt) { // Not a capture
-				ti.thread_hist.update_history(pos, move, ply, ss, bonus);
+				ti.hist->update_history(pos, move, ply, ss, bonus);
 				for (auto &qmove : quiets) {
-					ti.thread_hist.update_history(pos, qmove, ply, ss, -bonus); // Penalize quiet moves
+					ti.hist->update_history(pos, qmove, ply, ss, -bonus); // Penalize quiet moves
 				}
 			} else { // Capture
-				ti.thread_hist.update_capthist(pos, move, bonus);
+				ti.hist->update_capthist(pos, move, bonus);
 			}
 			for (auto &cmove : captures) {
-				ti.thread_hist.update_capthist(pos, cmove, -bonus);
+				ti.hist->update_capthist(pos, cmove, -bonus);
 			}
 			break;
 		}
@@ -1054,25 +1067,28 @@ Value negamax(Position &pos, ThreadInfo &ti, SSEntry *ss, int depth, Value alpha
 	if (!excluded && !in_check && !(best_move != NullMove && (best_iscapture || best_ispromo)) && !(flag == UPPER_BOUND && best >= cur_eval) && !(flag == LOWER_BOUND && best <= cur_eval)) {
 		// Best move is a quiet move, update Corrhist
 		int bonus = (best - cur_eval) * depth / 8;
-		ti.thread_corrhist.update_corrhist(pos, ss, ply, bonus);
+		ti.corrhist->update_corrhist(pos, ss, ply, bonus);
 	}
 
-	if (!excluded) {
+	// A root search without some of the moves does not give the position's value
+	if (!excluded && !(root && !ti.root_excluded.empty())) {
 		Move tt_move = best_move != NullMove ? best_move : tentry ? tentry->best_move
 																  : NullMove;
-		ttable.store(pos.zobrist, score_to_tt(best, ply), raw_eval, depth, flag, ttpv, tt_move);
+		ti.tt->store(pos.zobrist, score_to_tt(best, ply), raw_eval, depth, flag, ttpv, tt_move);
 	}
 
 	return best;
 }
 
 void iterativedeepening(Position &pos, ThreadInfo &ti, int depth) {
-	for (int i = 0; i < 64; i++) {
-		for (int j = 0; j < 64; j++) {
-			for (int k = 0; k < 2; k++) {
-				for (int l = 0; l < 2; l++) {
-					ti.thread_hist.history[0][i][j][k][l] = ti.thread_hist.history[0][i][j][k][l] * 3 / 4;
-					ti.thread_hist.history[1][i][j][k][l] = ti.thread_hist.history[1][i][j][k][l] * 3 / 4;
+	if (ti.decay_hist) {
+		for (int i = 0; i < 64; i++) {
+			for (int j = 0; j < 64; j++) {
+				for (int k = 0; k < 2; k++) {
+					for (int l = 0; l < 2; l++) {
+						hist_store(ti.hist->history[0][i][j][k][l], hist_load(ti.hist->history[0][i][j][k][l]) * 3 / 4);
+						hist_store(ti.hist->history[1][i][j][k][l], hist_load(ti.hist->history[1][i][j][k][l]) * 3 / 4);
+					}
 				}
 			}
 		}
@@ -1082,53 +1098,93 @@ void iterativedeepening(Position &pos, ThreadInfo &ti, int depth) {
 
 	Value static_eval = eval(pos, ti.am) * (pos.side ? -1 : 1);
 	int consec_move = 0;
+	int64_t last_tt_stats = 0;
+
+	/**
+	 * In MultiPV mode each iteration searches the root once per line. Every pass excludes the
+	 * moves ranked by the earlier ones and gets its own aspiration window around that line's
+	 * previous score; the passes share the TT, so the later ones are much cheaper than separate
+	 * searches. Like a single PV search, an iteration only counts once all of its passes are done.
+	 */
+	// The first iteration searches the root moves in the order the move picker would use
+	ti.root_list.clear();
+	{
+		auto tentry = ti.tt->probe(pos.zobrist);
+		MovePicker mp(pos, ti.ss, 0, ti.hist, tentry);
+		for (Move move; (move = mp.next()) != NullMove;) {
+			if (pos.is_legal(move) && std::find(ti.root_moves->begin(), ti.root_moves->end(), move) != ti.root_moves->end())
+				ti.root_list.emplace_back(move);
+		}
+	}
+
+	const int npv = std::max(1, std::min(multipv, (int)ti.root_list.size()));
+	ti.lines.assign(npv, PVLine());
+	std::vector<PVLine> cur(npv);
 
 	Move best_move = NullMove;
 	Value eval = -VALUE_INFINITE;
 	for (int d = 1; d <= depth; d++) {
-		int alpha = -VALUE_INFINITE, beta = VALUE_INFINITE;
-		int window_sz = asp_window();
-
-		if (eval != -VALUE_INFINITE && d >= 4) {
-			/**
-			 * Aspiration windows work by searching a small window around the expected value
-			 * of the position. By having a smaller window, our search runs faster.
-			 *
-			 * If we fail either high or low out of this window, we gradually expand the
-			 * window size, eventually getting to a full-width search.
-			 */
-			alpha = eval - window_sz;
-			beta = eval + window_sz;
-		}
+		for (RootMove &rm : ti.root_list)
+			rm.prev_score = rm.score;
+		std::stable_sort(ti.root_list.begin(), ti.root_list.end(), [](const RootMove &a, const RootMove &b) {
+			return a.prev_score != b.prev_score ? a.prev_score > b.prev_score : a.nodes > b.nodes;
+		});
+
+		ti.root_excluded.clear();
+		for (int k = 0; k < npv && !*ti.stop; k++) {
+			const Value prev = ti.lines[k].score;
+			int alpha = -VALUE_INFINITE, beta = VALUE_INFINITE;
+			int window_sz = asp_window();
+
+			if (prev != -VALUE_INFINITE && d >= 4) {
+				/**
+				 * Aspiration windows work by searching a small window around the expected value
+				 * of the position. By having a smaller window, our search runs faster.
+				 *
+				 * If we fail either high or low out of this window, we gradually expand the
+				 * window size, eventually getting to a full-width search.
+				 */
+				alpha = prev - window_sz;
+				beta = prev + window_sz;
+			}
 
-		auto result = negamax<true, true>(pos, ti, ti.ss, d, alpha, beta, pos.side ? -1 : 1, false, 0);
-		int asp_depth = d;
+			auto result = negamax<true, true>(pos, ti, ti.ss, d, alpha, beta, pos.side ? -1 : 1, false, 0);
+			int asp_depth = d;
 
-		// Gradually expand the window if we fail high or low
-		while ((result >= beta || result <= alpha) && !stop_search) {
-			if (result >= beta) {
-				// Fail high - expand upper bound
-				alpha = (alpha + beta) / 2;
-				beta = eval + window_sz * 2;
-				asp_depth = std::max(asp_depth - 1, d - 3);
-			}
-			if (result <= alpha) {
-				// Fail low - expand lower bound
-				alpha = eval - window_sz * 2;
-			}
-			if (window_sz >= VALUE_INFINITE / 4) { // give up, just use full window
-				alpha = -VALUE_INFINITE;
-				beta = VALUE_INFINITE;
+			// Gradually expand the window if we fail high or low
+			while ((result >= beta || result <= alpha) && !*ti.stop) {
+				if (result >= beta) {
+					// Fail high - expand upper bound
+					alpha = (alpha + beta) / 2;
+					beta = prev + window_sz * 2;
+					asp_depth = std::max(asp_depth - 1, d - 3);
+				}
+				if (result <= alpha) {
+					// Fail low - expand lower bound
+					alpha = prev - window_sz * 2;
+				}
+				if (window_sz >= VALUE_INFINITE / 4) { // give up, just use full window
+					alpha = -VALUE_INFINITE;
+					beta = VALUE_INFINITE;
+				}
+				alpha = std::clamp(alpha, -VALUE_INFINITE, (int)VALUE_INFINITE);
+				beta = std::clamp(beta, -VALUE_INFINITE, (int)VALUE_INFINITE);
+				window_sz *= 2;
+				result = negamax<true, true>(pos, ti, ti.ss, asp_depth, alpha, beta, pos.side ? -1 : 1, false, 0);
 			}
-			alpha = std::clamp(alpha, -VALUE_INFINITE, (int)VALUE_INFINITE);
-			beta = std::clamp(beta, -VALUE_INFINITE, (int)VALUE_INFINITE);
-			window_sz *= 2;
-			result = negamax<true, true>(pos, ti, ti.ss, asp_depth, alpha, beta, pos.side ? -1 : 1, false, 0);
+
+			cur[k].score = result;
+			cur[k].len = ti.pvlen[0];
+			std::copy(ti.pvtable[0], ti.pvtable[0] + ti.pvlen[0], cur[k].moves);
+			if (ti.pvlen[0])
+				ti.root_excluded.push_back(ti.pvtable[0][0]); // No PV if the root is mate or stalemate
 		}
-		if (stop_search)
+		if (*ti.stop)
 			break;
-		eval = result;
-		Move mv = ti.pvtable[0][0];
+		std::stable_sort(cur.begin(), cur.end(), [](const PVLine &a, const PVLine &b) { return a.score > b.score; });
+		ti.lines = cur;
+		eval = ti.lines[0].score;
+		Move mv = ti.lines[0].moves[0];
 
 		if (mv == best_move) {
 			consec_move++;
@@ -1138,11 +1194,16 @@ void iterativedeepening(Position &pos, ThreadInfo &ti, int depth) {
 
 		best_move = mv;
 
+		nodes[ti.id] = ti.nodecnt;
+		ti.maxdepth = d;
+		ti.eval = eval;
+		ti.root_pvlen = ti.lines[0].len;
+		std::copy(ti.lines[0].moves, ti.lines[0].moves + ti.lines[0].len, ti.root_pv);
+
 		if (ti.is_main) {
-			// We must calculate best move nodes and total nodes at around the same time
-			// so that node counts don't change in between due to race conditions
-			// This is a really crude way of doing it (todo change later)
-			uint64_t bm_nodes = nodecnt[best_move.src()][best_move.dst()];
+			// The best move's share of this thread's own effort
+			auto bm = std::find_if(ti.root_list.begin(), ti.root_list.end(), [&](const RootMove &rm) { return rm.move == best_move; });
+			uint64_t bm_nodes = bm != ti.root_list.end() ? bm->nodes : 0;
 			uint64_t tot_nodes = 0;
 			for (int t = 0; t < num_threads; t++) {
 				tot_nodes += nodes[t].get();
@@ -1150,28 +1211,17 @@ void iterativedeepening(Position &pos, ThreadInfo &ti, int depth) {
 
 			// UCI output from main thread only
 			auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
-			last_line.str("");
-
-			last_line << "info depth " << d << " seldepth " << ti.seldepth << " score " << score_to_uci(eval);
-
-			if (show_wdl) {
-				auto [w, dr, l] = score_to_wdl(pos, eval);
-				last_line << " wdl " << w << ' ' << dr << ' ' << l;
+			if (!minimal) {
+				for (int k = 0; k < npv; k++)
+					std::cout << info_line(pos, ti, k) << std::endl;
 			}
 
-			last_line << " time " << time_elapsed << " nodes " << tot_nodes << " nps " << (time_elapsed ? (tot_nodes * 1000 / time_elapsed) : tot_nodes);
-
-			// Hashfull is expensive to compute, so only compute it after a certain amount of time has passed
-			if (time_elapsed >= 500)
-				last_line << " hashfull " << (int)(get_ttable_sz() * 1000);
-
-			last_line << " tbhits " << tbhits.load(std::memory_order_relaxed) << " pv";
-
-			for (int ply = 0; ply < ti.pvlen[0]; ply++) {
-				last_line << " " << ti.pvtable[0][ply].to_string();
+			if (tt_stats_interval && !minimal && time_elapsed - last_tt_stats >= tt_stats_interval) {
+				const TTStats st = ttable.stats();
+				std::cout << "info string TT hashfull " << ttable.hashfull() << " probes " << st.probes << " hits " << st.hits << " stores " << st.stores
+						  << " collisions " << st.collisions << std::endl;
+				last_tt_stats = time_elapsed;
 			}
-			if (!minimal)
-				std::cout << last_line.str() << std::endl;
 
 			// only do time management on main thread
 			bool best_iscapt = pos.is_capture(best_move);
@@ -1185,37 +1235,80 @@ void iterativedeepening(Position &pos, ThreadInfo &ti, int depth) {
 				soft *= bm_stability;
 			}
 
-			double node_adjustment = node_base() / 100.0 - (node_mul() / 100.0) * (bm_nodes / (double)tot_nodes);
+			double node_adjustment = node_base() / 100.0 - (node_mul() / 100.0) * (bm_nodes / (double)std::max<uint64_t>(ti.nodecnt, 1));
 			soft *= node_adjustment;
 
 			if (abs(eval) >= VALUE_WIN)
 				soft = 0.1; // doesn't matter anymore
 
-			if (time_elapsed > mxtime * soft || tot_nodes >= mx_nodes) {
+			// Time spent pondering counts, so after a ponderhit we may move as soon as this iteration is done
+			if (!pondering && (time_elapsed > mxtime * soft || tot_nodes >= mx_nodes)) {
 				// We probably won't be able to complete the next ID loop
-				stop_search = true;
+				*ti.stop = true;
 				break;
 			}
 		}
+	}
 
-		ti.maxdepth = d;
+	nodes[ti.id] = ti.nodecnt;
+}
+
+/**
+ * Formats the UCI info line for the last completed iteration of a thread, or for its k-th best
+ * line in MultiPV mode. Nodes and time are those of the whole search.
+ */
+std::string info_line(Position &pos, ThreadInfo &ti, size_t k) {
+	uint64_t tot_nodes = 0;
+	for (int t = 0; t < num_threads; t++) {
+		tot_nodes += nodes[t].get();
+	}
+	auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	const bool multi = ti.lines.size() > 1;
+	const Value score = multi ? ti.lines[k].score : ti.eval;
+	const Move *pv = multi ? ti.lines[k].moves : ti.root_pv;
+	const int pvlen = multi ? ti.lines[k].len : ti.root_pvlen;
+
+	std::stringstream line;
+	line << "info depth " << ti.maxdepth << " seldepth " << ti.seldepth;
+	if (multi)
+		line << " multipv " << k + 1;
+	line << " score " << score_to_uci(score);
+
+	if (show_wdl) {
+		auto [w, dr, l] = score_to_wdl(pos, score);
+		line << " wdl " << w << ' ' << dr << ' ' << l;
 	}
 
-	ti.eval = eval;
+	line << " time " << time_elapsed << " nodes " << tot_nodes << " nps " << (time_elapsed ? (tot_nodes * 1000 / time_elapsed) : tot_nodes);
 
-	if (ti.is_main) {
-		stop_search = true;
-		if (minimal)
-			std::cout << last_line.str() << std::endl;
-		std::cout << "bestmove " << best_move.to_string() << std::endl;
+	line << " hashfull " << ttable.hashfull();
+
+	line << " tbhits " << tbhits.load(std::memory_order_relaxed) << " pv";
+
+	for (int ply = 0; ply < pvlen; ply++) {
+		line << " " << pv[ply].to_string();
 	}
+	return line.str();
 }
 
-void prepare_search(int64_t time, int64_t maxnodes, bool quiet, uint16_t num) {
-	for (int i = 0; i < 64; i++)
-		for (int j = 0; j < 64; j++)
-			nodecnt[i][j] = 0;
+/**
+ * Prints the final result of a search once every thread has stopped. The info line is repeated
+ * if the reported thread is not the one whose lines were printed during the search, or if nothing
+ * was printed at all.
+ */
+void report_bestmove(Position &pos, ThreadInfo &ti, bool show_info) {
+	if ((minimal || show_info) && ti.maxdepth) {
+		for (size_t k = 0; k < ti.lines.size(); k++)
+			std::cout << info_line(pos, ti, k) << std::endl;
+	}
+	std::cout << "bestmove " << (ti.root_pvlen ? ti.root_pv[0] : NullMove).to_string();
+	if (ti.root_pvlen >= 2)
+		std::cout << " ponder " << ti.root_pv[1].to_string();
+	std::cout << std::endl;
+}
 
+void prepare_search(int64_t time, int64_t maxnodes, bool quiet, uint16_t num) {
 	mxtime = time;
 	mx_nodes = maxnodes;
 	start = std::chrono::steady_clock::now();
@@ -1225,9 +1318,35 @@ void prepare_search(int64_t time, int64_t maxnodes, bool quiet, uint16_t num) {
 	tbhits.store(0, std::memory_order_relaxed);
 }
 
+std::vector<Move> list_root_moves(Position &pos, RepetitionHandler &rp, const std::vector<Move> &searchmoves) {
+	bool rep = false;
+	for (int i = rp.hash_hist.size() - 2; i >= 0; i--) {
+		if (rp.hash_hist[i] == pos.zobrist_without_ep()) {
+			rep = true;
+			break;
+		}
+	}
+
+	pzstd::vector<Move> moves;
+	pos.legal_moves(moves);
+	std::vector<Move> root_moves;
+	for (Move &move : moves) {
+		if (pos.is_legal(move) && (searchmoves.empty() || std::find(searchmoves.begin(), searchmoves.end(), move) != searchmoves.end()))
+			root_moves.push_back(move);
+	}
+	if (root_moves.empty() && !searchmoves.empty())
+		return list_root_moves(pos, rp); // None of them can be played here, so search everything
+	// Unless that would leave nothing to search, only keep the moves that preserve the TB result
+	const std::unordered_set<uint16_t> tb_moves = tbman.probe_moves(pos, rep);
+	if (std::any_of(root_moves.begin(), root_moves.end(), [&](Move move) { return tb_moves.count(move.data); }))
+		std::erase_if(root_moves, [&](Move move) { return !tb_moves.count(move.data); });
+	return root_moves;
+}
+
 void clear_search_vars(ThreadInfo &ti) {
-	memset(&ti.thread_hist, 0, sizeof(History));
-	memset(&ti.thread_corrhist, 0, sizeof(Corrhist));
+	memset(ti.hist, 0, sizeof(History));
+	memset(ti.corrhist, 0, sizeof(Corrhist));
+	ti.eval_cache.clear();
 	for (int i = -8; i < MAX_PLY + 8; i++) {
 		ti.ss[i] = SSEntry();
 	}
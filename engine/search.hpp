@@ -63,18 +63,25 @@
 // History pruning margin
 #define HISTORY_MARGIN 2753
 
-extern bool stop_search;
+// Static evaluation cache entries per thread (must be a power of two)
+#define EVAL_CACHE_SIZE 65536
+
+extern std::atomic<bool> stop_search;
+extern std::atomic<bool> pondering;
 extern bool show_wdl;
+extern int multipv;
 extern bool do_softnodes;
 extern bool do_datagen;
+extern int64_t tt_stats_interval;
 
+/**
+ * The published node count of one search thread. Threads count into a plain member of their
+ * ThreadInfo and only store it here every 1024 nodes and at the end of each iteration, so
+ * other threads see a slightly stale value but no atomic read-modify-write is done per node.
+ */
 struct alignas(64) NodeCounter {
 	std::atomic<uint64_t> val = 0;
 
-	void operator++(int) {
-		val.fetch_add(1, std::memory_order_relaxed);
-	}
-
 	void operator=(uint64_t new_val) {
 		val.store(new_val, std::memory_order_relaxed);
 	}
@@ -85,7 +92,57 @@ struct alignas(64) NodeCounter {
 };
 
 extern NodeCounter nodes[MAX_THREADS];
-extern std::unordered_set<uint16_t> tb_moves;
+
+/**
+ * Remembers recent static evaluations of a single thread, so that positions that are reached again
+ * (through transpositions or re-searches) skip the accumulator updates and the network. Being per
+ * thread, the entries need no validation against torn writes; each one packs the upper 48 bits of
+ * the key with the 16-bit evaluation.
+ *
+ * The evaluation is scaled by the halfmove clock, so the clock is mixed into the key.
+ */
+struct EvalCache {
+	uint64_t entries[EVAL_CACHE_SIZE] = {};
+	std::atomic<uint64_t> probes = 0, hits = 0; // Only written by the owning thread
+
+	static uint64_t key(const Position &pos) { return pos.zobrist ^ (pos.halfmove * 0x9E3779B97F4A7C15ULL); }
+
+	std::optional<Value> probe(uint64_t key) {
+		probes.store(probes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		const uint64_t entry = entries[key & (EVAL_CACHE_SIZE - 1)];
+		if ((entry ^ key) >> 16)
+			return {};
+		hits.store(hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return (Value)(uint16_t)entry;
+	}
+
+	void store(uint64_t key, Value eval) { entries[key & (EVAL_CACHE_SIZE - 1)] = (key & ~0xffffULL) | (uint16_t)eval; }
+
+	void clear() { memset(entries, 0, sizeof(entries)); }
+};
+
+/**
+ * A move of the root list of one thread. The list is sorted before every iteration by the scores of
+ * the last one, so the best move is searched first, and the moves that were only proven worse by
+ * their upper bounds come in order of the effort spent on them.
+ */
+struct RootMove {
+	Move move;
+	Value score = -VALUE_INFINITE; // Exact or lower bound if the move raised alpha in its last search, -VALUE_INFINITE otherwise
+	Value prev_score = -VALUE_INFINITE; // Score after the last completed iteration
+	uint64_t nodes = 0; // Nodes searched below the move in this search
+	int pvlen = 0;
+	Move pv[MAX_PLY + 5];
+
+	RootMove(Move move) : move(move) {}
+};
+
+// One of the lines reported in MultiPV mode: a root move's score and PV
+struct PVLine {
+	Value score = -VALUE_INFINITE;
+	int len = 0;
+	Move moves[MAX_PLY + 5];
+};
 
 struct alignas(4096) ThreadInfo {
 	Position pos;
@@ -95,13 +152,28 @@ struct alignas(4096) ThreadInfo {
 	Value eval = 0;
 	bool is_main = false;
 	RepetitionHandler rp;
-	alignas(64) History thread_hist;
-	alignas(64) Corrhist thread_corrhist;
+	History *hist = nullptr; // Possibly shared with other threads, see HistoryTables
+	Corrhist *corrhist = nullptr;
+	HistoryTables *own_tables = nullptr; // Tables allocated for this thread alone, if it has any
+	bool decay_hist = false; // Whether this thread ages `hist` at the start of a search, so a shared table is aged only once
 	Move pvtable[MAX_PLY + 5][MAX_PLY + 5];
 	int pvlen[MAX_PLY + 5] = {};
 	AccumulatorManager am;
+	EvalCache eval_cache;
+	uint64_t nodecnt = 0; // Nodes searched by this thread, see NodeCounter
+	Move root_pv[MAX_PLY + 5]; // PV of the last completed iteration (whose depth and score are maxdepth and eval)
+	int root_pvlen = 0;
+	std::vector<PVLine> lines; // Best lines of the last completed iteration, best first; the first one is root_pv
+	const std::vector<Move> *root_moves = nullptr; // The legal root moves that may be searched, owned by the Pool
+	std::vector<RootMove> root_list; // This thread's ordering of root_moves, see RootMove
+	std::vector<Move> root_excluded; // Root moves already ranked by earlier MultiPV passes of this iteration
 	bool nmp_disable = false;
 
+	// A thread searching on its own (see batch.cpp) has its own stop flag, node limit and possibly TT
+	std::atomic<bool> *stop = &stop_search;
+	uint64_t max_nodes = UINT64_MAX; // Checked by threads other than the pool's main thread, which uses the search's limit
+	TTable *tt = &ttable;
+
 	ThreadInfo() : am(pos) {
 		ss = (new SSEntry[MAX_PLY + 16]) + 8;
 	}
@@ -113,8 +185,21 @@ struct alignas(4096) ThreadInfo {
 
 void prepare_search(int64_t time, int64_t maxnodes, bool quiet, uint16_t num_threads);
 
+/**
+ * Lists the legal root moves a search may play: those in `searchmoves` (all if it is empty or none
+ * of them is legal), and of these only the ones that keep the TB result if the position is in the
+ * tablebases.
+ */
+std::vector<Move> list_root_moves(Position &pos, RepetitionHandler &rp, const std::vector<Move> &searchmoves = {});
+
 void iterativedeepening(Position &pos, ThreadInfo &ti, int depth);
 
+std::string score_to_uci(Value score);
+
+std::string info_line(Position &pos, ThreadInfo &ti, size_t k = 0);
+
+void report_bestmove(Position &pos, ThreadInfo &ti, bool show_info);
+
 uint64_t perft(Position &pos, int depth);
 
 void clear_search_vars(ThreadInfo &ti);
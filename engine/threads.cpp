@@ -18,93 +18,355 @@
 
 #include "threads.hpp"
 
+#include <sstream>
+
 #ifdef USE_NUMA
 #include <numa.h>
 #endif
 
+/**
+ * Starts threads [from, to) and waits until each has constructed its ThreadInfo
+ */
+void Pool::spawn(size_t from, size_t to) {
+	tis.resize(to, nullptr);
+	init_barrier = std::make_unique<std::barrier<>>(to - from + 1);
+	for (size_t i = from; i < to; ++i) {
+		threads.emplace_back(&Pool::thread_loop, this, i);
+	}
+	init_barrier->arrive_and_wait();
+}
+
 void Pool::resize(size_t num) {
 	if (num == num_threads)
 		return;
+	reconfigure_threads(num);
+}
 
+/**
+ * The barriers have a fixed number of participants, so they must be rebuilt, which is only safe
+ * while no thread is inside one. We release every thread from the start barrier with
+ * `reconfigure` set; threads past the new count exit, and the others attach to their history
+ * tables again (the sharing mode may have changed), report that they have left the barrier
+ * (`parked`) and sleep until `epoch` changes. Only then are the barriers replaced, new threads
+ * started and the kept threads woken up.
+ */
+void Pool::reconfigure_threads(size_t num) {
+	finish_clear();
 	std::unique_lock lock(mtx);
 
-	stop = true;
+	const size_t kept = std::min(num, num_threads);
+	reconfigure = true;
+	resize_target = num;
+	reconfigure_epoch = epoch.load();
+	parked = 0;
 	start_barrier->arrive_and_wait();
-	for (auto &t : threads) {
-		t.join();
+
+	for (size_t i = kept; i < num_threads; ++i) {
+		threads[i].join();
 	}
-	threads.clear();
-	for (size_t i = 0; i < num_threads; ++i) {
-		tis[i].~ThreadInfo();
+	threads.resize(kept);
+	tis.resize(kept);
+	for (size_t p; (p = parked.load()) != kept;)
+		parked.wait(p);
+
+	// Every kept thread has attached to its tables again, so shared tables nobody uses can go
+	for (HistoryTables *&tables : shared_tables) {
+		if (tables && std::none_of(tis.begin(), tis.end(), [&](ThreadInfo *ti) { return ti->hist == &tables->hist; })) {
+			large_free(tables, sizeof(HistoryTables));
+			tables = nullptr;
+		}
 	}
-	large_free(tis, num_threads * sizeof(ThreadInfo));
 
+	reconfigure = false;
 	num_threads = num;
-	stop = false;
-	tis = (ThreadInfo *)large_alloc(num_threads * sizeof(ThreadInfo));
+	best = 0; // May have been one of the retired threads
 	start_barrier = std::make_unique<std::barrier<>>(num_threads + 1);
 	ready_barrier = std::make_unique<std::barrier<>>(num_threads + 1);
-	init_barrier = std::make_unique<std::barrier<>>(num_threads + 1);
-	for (size_t i = 0; i < num_threads; ++i) {
-		threads.emplace_back(&Pool::thread_loop, this, i);
+	if (num_threads > kept)
+		spawn(kept, num_threads);
+
+	epoch.fetch_add(1);
+	epoch.notify_all();
+}
+
+void Pool::set_history_sharing(HistorySharing sharing) {
+	{
+		std::unique_lock lock(mtx);
+		hist_sharing = sharing;
+	}
+	// Only the threads themselves allocate their tables, so that they are placed on their node
+	reconfigure_threads(num_threads);
+}
+
+/**
+ * Points thread i at the history tables it should use under the current sharing mode, allocating
+ * them if it is the first to need them. Called by the thread itself, so that first touch places
+ * per-thread and per-node tables on the thread's node.
+ */
+void Pool::attach_history(size_t i) {
+	ThreadInfo &ti = *tis[i];
+	HistoryTables *tables;
+	if (hist_sharing == HIST_PER_THREAD) {
+		if (!ti.own_tables)
+			ti.own_tables = new (large_alloc(sizeof(HistoryTables))) HistoryTables();
+		tables = ti.own_tables;
+	} else {
+		size_t slot = 0;
+#ifdef USE_NUMA
+		if (hist_sharing == HIST_PER_NODE && numa_available() != -1)
+			slot = std::max(0, numa_node_of_cpu(sched_getcpu()));
+#endif
+		std::lock_guard lock(hist_mtx);
+		if (shared_tables.size() <= slot)
+			shared_tables.resize(slot + 1, nullptr);
+		if (!shared_tables[slot])
+			shared_tables[slot] = new (large_alloc(sizeof(HistoryTables))) HistoryTables();
+		tables = shared_tables[slot];
+		if (ti.own_tables) {
+			large_free(ti.own_tables, sizeof(HistoryTables));
+			ti.own_tables = nullptr;
+		}
+	}
+	ti.hist = &tables->hist;
+	ti.corrhist = &tables->corrhist;
+}
+
+std::string Pool::history_desc() const {
+	std::vector<const History *> distinct;
+	for (const ThreadInfo *ti : tis) {
+		if (std::find(distinct.begin(), distinct.end(), ti->hist) == distinct.end())
+			distinct.push_back(ti->hist);
+	}
+	const char *mode = hist_sharing == HIST_PER_THREAD ? "per thread" : hist_sharing == HIST_PER_NODE ? "per NUMA node" : "shared by the pool";
+	std::stringstream ss;
+	ss << std::fixed << std::setprecision(1) << "History " << mode << ": " << distinct.size() << " x "
+	   << sizeof(HistoryTables) / 1048576.0 << " MB = " << distinct.size() * sizeof(HistoryTables) / 1048576.0 << " MB";
+	return ss.str();
+}
+
+/**
+ * Sleeps until the deadline of the current search and then stops it, so that the search threads
+ * never have to read the clock and the stop happens at the deadline rather than at the main
+ * thread's next poll.
+ */
+void Pool::timer_loop() {
+	std::unique_lock lock(timer_mtx);
+	while (!timer_exit) {
+		if (!deadline) {
+			timer_cv.wait(lock);
+		} else if (timer_cv.wait_until(lock, *deadline) == std::cv_status::timeout && deadline && std::chrono::steady_clock::now() >= *deadline) {
+			stop_search = true;
+			deadline.reset();
+		}
+	}
+}
+
+void Pool::set_deadline(std::optional<std::chrono::steady_clock::time_point> new_deadline) {
+	{
+		std::lock_guard lock(timer_mtx);
+		deadline = new_deadline;
+	}
+	timer_cv.notify_one();
+}
+
+void Pool::repin() {
+	for (size_t i = 0; i < threads.size(); ++i) {
+		affinity.pin(threads[i], i);
 	}
-	init_barrier->arrive_and_wait();
 }
 
 void Pool::thread_loop(size_t i) {
+	if (!affinity.pin_self(i)) {
 #ifdef USE_NUMA
-	int node = i % numa_num_configured_nodes();
-	numa_run_on_node(node);
-	sched_yield();
+		int node = i % numa_num_configured_nodes();
+		numa_run_on_node(node);
+		sched_yield();
 #endif
-	new (&tis[i]) ThreadInfo(); // construct in thread loop for better NUMA locality
+	}
+	// Allocated and constructed by the thread itself, so that the first touch places it on our node
+	tis[i] = new (large_alloc(sizeof(ThreadInfo))) ThreadInfo();
+	tis[i]->am.net = local_network();
+	attach_history(i);
 	init_barrier->arrive_and_wait();
 	while (true) {
 		start_barrier->arrive_and_wait();
 		if (stop)
 			break;
+		if (reconfigure) {
+			if (i >= resize_target)
+				break;
+			attach_history(i);
+			parked.fetch_add(1);
+			parked.notify_all();
+			epoch.wait(reconfigure_epoch);
+			continue;
+		}
+		if (clearing) {
+			ttable.help_clear();
+			clear_acks.fetch_add(1);
+			clear_acks.notify_all();
+			continue;
+		}
 		if (i == 0)
 			ttable.inc_gen();
+		// repin() may have moved us to another node since the last search
+		tis[i]->am.net = local_network();
 		{
 			std::shared_lock lock(mtx);
 			ready_barrier->arrive_and_wait();
 
-			iterativedeepening(pos, tis[i], depth);
+			iterativedeepening(pos, *tis[i], depth);
+
+			if (i == 0) {
+				// The result of a ponder search may only be sent after the ponderhit or stop
+				for (bool p; (p = pondering.load());)
+					pondering.wait(p);
+				// The main thread decides when to stop, then waits for the helpers before picking a result
+				stop_search = true;
+				set_deadline({});
+				running.fetch_sub(1);
+				for (size_t r; (r = running.load()) != 0;)
+					running.wait(r);
+				// The other lines of a MultiPV search only make sense together with the main thread's
+				best = voting && multipv == 1 ? pick_best_thread() : 0;
+				report_bestmove(pos, *tis[best], best != 0);
+			} else {
+				running.fetch_sub(1);
+				running.notify_all();
+			}
 		}
 	}
+
+	if (tis[i]->own_tables)
+		large_free(tis[i]->own_tables, sizeof(HistoryTables));
+	tis[i]->~ThreadInfo();
+	large_free(tis[i], sizeof(ThreadInfo));
 }
 
-void Pool::search(Position &pos, RepetitionHandler &rp, int64_t time, int depth, int64_t maxnodes, bool quiet) {
+void Pool::search(Position &pos, RepetitionHandler &rp, int64_t time, int depth, int64_t maxnodes, bool quiet, bool ponder,
+				  const std::vector<Move> &searchmoves) {
+	finish_clear();
+	ttable.wait_clear();
+	pondering = ponder;
+	ponder_time = time;
+	// Replace any old deadline before the stop flag is cleared, so that it cannot fire into this search
+	if (time < (int64_t)1e12 && !ponder)
+		set_deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(time));
+	else
+		set_deadline({});
 	prepare_search(time, maxnodes, quiet, num_threads);
 	this->depth = depth;
 	this->pos = pos;
 
 	for (int t = 0; t < num_threads; t++) {
-		ThreadInfo &ti = tis[t];
+		ThreadInfo &ti = *tis[t];
+		ti.decay_hist = std::none_of(tis.begin(), tis.begin() + t, [&](ThreadInfo *other) { return other->hist == ti.hist; });
 		ti.rp = rp;
 		ti.am.full_refresh(pos, 0);
 		ti.seldepth = 0;
+		ti.maxdepth = 0;
+		ti.eval = -VALUE_INFINITE;
+		ti.root_pvlen = 0;
+		ti.nodecnt = 0;
 		nodes[t] = 0;
 		ti.id = t;
 		ti.is_main = (t == 0);
+		ti.root_moves = &root_moves;
 	}
 
-	bool rep = false;
-	for (int i = rp.hash_hist.size() - 2; i >= 0; i--) {
-		if (rp.hash_hist[i] == pos.zobrist_without_ep()) {
-			rep = true;
-			break;
-		}
-	}
-	tb_moves = tbman.probe_moves(pos, rep);
+	root_moves = list_root_moves(pos, rp, searchmoves);
 
+	best = 0;
+	running = num_threads;
 	start_barrier->arrive_and_wait();
 	ready_barrier->arrive_and_wait();
 }
 
+void Pool::ponderhit() {
+	if (!pondering)
+		return;
+	if (ponder_time < (int64_t)1e12)
+		set_deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(ponder_time));
+	pondering = false;
+	pondering.notify_all();
+}
+
+void Pool::clear_tt() {
+	finish_clear();
+	ttable.clear();
+	clear_acks = 0;
+	clearing = true;
+	start_barrier->arrive_and_wait();
+}
+
+/**
+ * Waits for the TT clear handed out by `clear_tt`, and for every thread to leave it, so that the
+ * start barrier can be used for something else again.
+ */
+void Pool::finish_clear() {
+	if (!clearing)
+		return;
+	ttable.wait_clear();
+	for (size_t a; (a = clear_acks.load()) != num_threads;)
+		clear_acks.wait(a);
+	clearing = false;
+}
+
+void Pool::interrupt() {
+	stop_search = true;
+	pondering = false;
+	pondering.notify_all();
+}
+
+/**
+ * Every thread votes for the first move of its last completed PV, weighted by how far its score is
+ * above the worst one and by its completed depth, so that deeper and more optimistic threads count
+ * more. The move with the most votes wins, reported through the thread that supports it most.
+ *
+ * Proven results bypass the vote: a thread that found a win is always taken (the fastest one if
+ * several did), and a thread whose best is a proven loss is never preferred over one without.
+ */
+size_t Pool::pick_best_thread() {
+	Value min_score = VALUE_INFINITE;
+	for (size_t t = 0; t < num_threads; t++) {
+		if (tis[t]->root_pvlen)
+			min_score = std::min(min_score, tis[t]->eval);
+	}
+
+	std::vector<int64_t> weight(num_threads, 0), votes(num_threads, 0);
+	for (size_t t = 0; t < num_threads; t++) {
+		if (tis[t]->root_pvlen)
+			weight[t] = (int64_t)(tis[t]->eval - min_score + 14) * tis[t]->maxdepth;
+	}
+	for (size_t t = 0; t < num_threads; t++) {
+		for (size_t u = 0; u < num_threads; u++) {
+			if (tis[u]->root_pvlen && tis[t]->root_pvlen && tis[u]->root_pv[0] == tis[t]->root_pv[0])
+				votes[t] += weight[u];
+		}
+	}
+
+	size_t best_thread = 0;
+	for (size_t t = 1; t < num_threads; t++) {
+		const ThreadInfo &ti = *tis[t], &bt = *tis[best_thread];
+		if (!ti.root_pvlen)
+			continue;
+		if (!bt.root_pvlen) {
+			best_thread = t;
+		} else if (abs(bt.eval) >= VALUE_WIN) {
+			if (ti.eval > bt.eval)
+				best_thread = t;
+		} else if (ti.eval >= VALUE_WIN) {
+			best_thread = t;
+		} else if (ti.eval > -VALUE_WIN && (votes[t] > votes[best_thread] || (votes[t] == votes[best_thread] && weight[t] > weight[best_thread]))) {
+			best_thread = t;
+		}
+	}
+	return best_thread;
+}
+
 std::pair<Move, Value> Pool::wait_finished() {
 	std::unique_lock lock(mtx);
 
-	ThreadInfo &best_thread = tis[0];
-	return {best_thread.pvtable[0][0], best_thread.eval};
+	ThreadInfo &best_thread = *tis[best];
+	return {best_thread.root_pvlen ? best_thread.root_pv[0] : NullMove, best_thread.eval};
 }
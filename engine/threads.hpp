@@ -19,9 +19,11 @@
 #pragma once
 
 #include "includes.hpp"
+#include "affinity.hpp"
 #include "search.hpp"
 
 #include <barrier>
+#include <condition_variable>
 #include <mutex>
 #include <shared_mutex>
 #include <thread>
@@ -32,63 +34,152 @@ private:
 	size_t num_threads;
 	std::vector<std::thread> threads;
 	Position pos;
-	ThreadInfo *tis;
+	std::vector<ThreadInfo *> tis; // Each thread allocates (and frees) its own, see thread_loop
 
 	std::unique_ptr<std::barrier<>> start_barrier, ready_barrier, init_barrier;
 	std::shared_mutex mtx;
 	bool stop;
 
+	// Resize handshake, see `resize`
+	bool reconfigure = false;
+	size_t resize_target = 0;
+	std::atomic<size_t> epoch = 0, parked = 0;
+	size_t reconfigure_epoch = 0;
+
 	int depth;
 
+	// Stops the search at the hard time limit, see `timer_loop`
+	std::thread timer;
+	std::mutex timer_mtx;
+	std::condition_variable timer_cv;
+	std::optional<std::chrono::steady_clock::time_point> deadline;
+	bool timer_exit = false;
+
+	// History tables shared by several threads (one per NUMA node, or only the first for the whole
+	// pool), see `attach_history`
+	HistorySharing hist_sharing = HIST_PER_THREAD;
+	std::vector<HistoryTables *> shared_tables;
+	std::mutex hist_mtx;
+
+	// TT clearing handed to the threads, see `clear_tt`
+	bool clearing = false;
+	std::atomic<size_t> clear_acks = 0;
+
+	std::atomic<size_t> running = 0; // Threads that have not finished iterativedeepening yet
+	size_t best = 0; // Thread whose result was reported for the last search
+	int64_t ponder_time = 0; // Time limit of a ponder search, applied at the ponderhit
+	std::vector<Move> root_moves; // Root moves the current search may play, see `search`
+
 	void thread_loop(size_t i);
 
+	void spawn(size_t from, size_t to);
+
+	void reconfigure_threads(size_t num);
+
+	void attach_history(size_t i);
+
+	void timer_loop();
+
+	void set_deadline(std::optional<std::chrono::steady_clock::time_point> new_deadline);
+
+	void finish_clear();
+
+	size_t pick_best_thread();
+
 public:
-	Pool() : num_threads(1), stop(false) {
-		tis = (ThreadInfo *)large_alloc(num_threads * sizeof(ThreadInfo));
-		start_barrier = std::make_unique<std::barrier<>>(2);
-		ready_barrier = std::make_unique<std::barrier<>>(2);
-		init_barrier = std::make_unique<std::barrier<>>(2);
-		threads.emplace_back(&Pool::thread_loop, this, 0);
-		init_barrier->arrive_and_wait();
-	}
+	bool voting = true; // Choose the reported move by voting over all threads instead of taking the main thread's
+
+	Pool() : Pool(1) {}
 
 	Pool(size_t num_threads) : num_threads(num_threads), stop(false) {
-		tis = (ThreadInfo *)large_alloc(num_threads * sizeof(ThreadInfo));
 		start_barrier = std::make_unique<std::barrier<>>(num_threads + 1);
 		ready_barrier = std::make_unique<std::barrier<>>(num_threads + 1);
-		init_barrier = std::make_unique<std::barrier<>>(num_threads + 1);
-		for (size_t i = 0; i < num_threads; ++i) {
-			threads.emplace_back(&Pool::thread_loop, this, i);
-		}
-		init_barrier->arrive_and_wait();
+		spawn(0, num_threads);
+		timer = std::thread(&Pool::timer_loop, this);
 	}
 
+	/**
+	 * Changes the number of threads, only starting or retiring the difference. Threads that are
+	 * kept also keep their ThreadInfo (histories, correction histories and NUMA placement).
+	 */
 	void resize(size_t num);
 
-	void search(Position &pos, RepetitionHandler &rp, int64_t time, int depth, int64_t maxnodes, bool quiet);
+	/**
+	 * Applies the current CPU pinning policy to the running threads. Going back to no pinning
+	 * lets the threads run anywhere again, including off the NUMA node they were started on.
+	 */
+	void repin();
+
+	/**
+	 * Switches between per-thread and shared history tables. Threads that move to shared tables
+	 * give up what they had learnt, and the shared tables start out empty.
+	 */
+	void set_history_sharing(HistorySharing sharing);
+
+	// Describes the memory used by the history tables, for UCI output
+	std::string history_desc() const;
+
+	/**
+	 * Starts a search in the background. A ponder search runs without a time limit until `ponderhit`
+	 * or `stop`; `time` only starts counting at the ponderhit.
+	 *
+	 * Only the legal moves in `searchmoves` (all of them if it is empty or none is legal) are searched at the root,
+	 * further narrowed to the moves that keep the TB result when the position is in the tablebases.
+	 */
+	void search(Position &pos, RepetitionHandler &rp, int64_t time, int depth, int64_t maxnodes, bool quiet, bool ponder = false,
+				const std::vector<Move> &searchmoves = {});
+
+	/**
+	 * The opponent played the move we were pondering on: the running search becomes a normal timed
+	 * search, keeping everything it has searched so far.
+	 */
+	void ponderhit();
+
+	// Stops the running search, including one that is pondering
+	void interrupt();
+
+	/**
+	 * Empties the TT on the idle search threads and returns immediately; they are pinned and
+	 * otherwise asleep until the next `go`. The next search first waits for (and helps with) the
+	 * rest, see TTable::clear.
+	 */
+	void clear_tt();
 
 	void clear_search_vars() {
 		std::unique_lock lock(mtx);
 		for (size_t i = 0; i < num_threads; i++) {
-			::clear_search_vars(tis[i]);
+			::clear_search_vars(*tis[i]);
 		}
 	}
 
+	size_t size() const { return num_threads; }
+
 	ThreadInfo &get_ti(size_t i) {
-		return tis[i];
+		return *tis[i];
 	}
 
 	std::pair<Move, Value> wait_finished();
 
+	// Describes the pages backing the per-thread search data, for UCI output
+	std::string placement() const { return std::to_string(num_threads * sizeof(ThreadInfo) / 1024) + " KB of thread data on " + large_page_desc(tis[0]); }
+
 	~Pool() {
+		finish_clear();
+		{
+			std::lock_guard lock(timer_mtx);
+			timer_exit = true;
+		}
+		timer_cv.notify_one();
+		timer.join();
+
 		stop = true;
 		start_barrier->arrive_and_wait();
 		for (auto &t : threads) {
 			t.join();
 		}
-		for (size_t i = 0; i < num_threads; ++i) {
-			tis[i].~ThreadInfo();
+		for (HistoryTables *tables : shared_tables) {
+			if (tables)
+				large_free(tables, sizeof(HistoryTables));
 		}
-		large_free(tis, num_threads * sizeof(ThreadInfo));
 	}
 };
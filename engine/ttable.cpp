@@ -18,31 +18,571 @@
 
 #include "ttable.hpp"
 
+#include <deque>
+#include <mutex>
+#include <sstream>
+
+#ifdef USE_NUMA
+#include <numa.h>
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 TTable ttable(DEFAULT_TT_SIZE);
 
-void TTable::store(uint64_t key, Value eval, Value s_eval, uint8_t depth, uint8_t bound, bool ttpv, Move best_move) {
-	TTBucket *bucket = TT + (key & (TT_SIZE - 1));
+#define TT_CLEAR_CHUNK ((size_t)16 * 1024 * 1024 / sizeof(TTable::TTBucket)) // Buckets per background clearing chunk
 
-	key >>= 48; // Use upper 16 bits for the key (since we already verified bottom n bits)
-	
-	TTEntry entry = bucket->entries[0];
-	uint8_t idx = 0;
+#define TT_FILE_MAGIC 0x485341485a50ULL // "PZHASH"
+#define TT_FILE_VERSION 1
+#define TT_FILE_CHUNK (64ULL * 1024 * 1024) // Bytes per read/write call
+
+#define TT_SHM_MAGIC 0x4d48535a50ULL // "PZSHM"
+#define TT_SHM_HEADER 4096 // Bytes reserved in front of the buckets of a shared table
+
+/**
+ * Lives at the start of a shared segment. The atomics are lock-free and therefore also work
+ * across processes.
+ */
+struct TTShmHeader {
+	uint64_t magic;
+	uint64_t bucket_bytes;
+	uint64_t tt_size;
+	std::atomic<uint32_t> refs; // Attached processes
+	std::atomic<uint32_t> ready; // Set by the creator once the buckets are cleared
+	std::atomic<uint8_t> age; // Generation shared by all processes (below TT_GEN_SZ), see inc_gen
+};
+
+struct TTFileHeader {
+	uint64_t magic = TT_FILE_MAGIC;
+	uint64_t version = TT_FILE_VERSION;
+	uint64_t bucket_bytes = sizeof(TTable::TTBucket);
+	uint64_t bucket_entries = TT_BUCKET_SZ;
+	uint64_t tt_size = 0;
+	uint64_t age = 0;
+	uint64_t checksum = 0;
+};
+
+// Cheap checksum over whole words. Four independent lanes keep it from being latency-bound.
+static uint64_t tt_checksum(const void *ptr, size_t bytes, uint64_t h) {
+	const uint64_t *words = (const uint64_t *)ptr;
+	uint64_t lanes[4] = {h, h ^ 1, h ^ 2, h ^ 3};
+	for (size_t i = 0; i < bytes / 8; i++)
+		lanes[i & 3] = (lanes[i & 3] ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+	return (lanes[0] ^ (lanes[1] << 1) ^ (lanes[2] << 2) ^ (lanes[3] << 3)) * 0x9E3779B97F4A7C15ULL;
+}
+
+// Every thread that touches the table gets its own counters. A deque never moves its elements, so
+// the thread-local pointers stay valid as threads register. An exiting thread hands its slot to the
+// next new one, counts included so the totals never go backwards, so short-lived threads (batch
+// workers, resized pools) don't grow the deque.
+static std::mutex tt_stats_mtx;
+static std::deque<TTStats> tt_stats_slots;
+static std::vector<TTStats *> tt_stats_free;
+static thread_local TTStats *tt_stats = nullptr;
+static thread_local TTStats tt_stats_discard; // Sink for tables that don't count, see TTable::count_stats
+
+struct TTStatsRelease {
+	~TTStatsRelease() {
+		std::lock_guard lock(tt_stats_mtx);
+		tt_stats_free.push_back(tt_stats);
+	}
+};
+
+static TTStats &local_stats() {
+	if (!tt_stats) [[unlikely]] {
+		// Kept out of the fast path, a thread_local with a destructor needs a guard on every access
+		static thread_local TTStatsRelease release;
+		std::lock_guard lock(tt_stats_mtx);
+		if (!tt_stats_free.empty()) {
+			tt_stats = tt_stats_free.back();
+			tt_stats_free.pop_back();
+		} else {
+			tt_stats = &tt_stats_slots.emplace_back();
+		}
+	}
+	return *tt_stats;
+}
 
-	if (entry.key != 0 && entry.key != key) {
-		for (uint8_t i = 1; i < 3; i++) {
-			const TTEntry nentry = bucket->entries[i];
-			if (nentry.key == key) {
-				entry = nentry;
-				idx = i;
-				break;
+// Only the owning thread writes a counter, so a relaxed load and store is enough (and much cheaper than fetch_add)
+static inline void bump(uint64_t &counter) {
+	std::atomic_ref<uint64_t> ref(counter);
+	ref.store(ref.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static inline uint64_t peek(uint64_t &counter) { return std::atomic_ref<uint64_t>(counter).load(std::memory_order_relaxed); }
+
+TTStats &TTStats::operator-=(const TTStats &o) {
+	probes -= o.probes;
+	hits -= o.hits;
+	stores -= o.stores;
+	skipped -= o.skipped;
+	collisions -= o.collisions;
+	fills -= o.fills;
+	for (int d = 0; d < TT_STATS_DEPTHS; d++) {
+		for (int b = 0; b < 4; b++)
+			writes[d][b] -= o.writes[d][b];
+	}
+	return *this;
+}
+
+static TTStats tt_stats_total() {
+	TTStats total;
+	std::lock_guard lock(tt_stats_mtx);
+	for (TTStats &slot : tt_stats_slots) {
+		total.probes += peek(slot.probes);
+		total.hits += peek(slot.hits);
+		total.stores += peek(slot.stores);
+		total.skipped += peek(slot.skipped);
+		total.collisions += peek(slot.collisions);
+		total.fills += peek(slot.fills);
+		for (int d = 0; d < TT_STATS_DEPTHS; d++) {
+			for (int b = 0; b < 4; b++)
+				total.writes[d][b] += peek(slot.writes[d][b]);
+		}
+	}
+	return total;
+}
+
+static int tt_depth_class(uint8_t depth) {
+	if (depth == 0)
+		return 0;
+	return std::min(TT_STATS_DEPTHS - 1, 1 + (depth >= 4) + (depth >= 8) + (depth >= 16));
+}
+
+static int tt_numa_nodes() {
+#ifdef USE_NUMA
+	if (numa_available() != -1)
+		return numa_num_configured_nodes();
+#endif
+	return 1;
+}
+
+void TTable::allocate() {
+	TT = (TTBucket *)large_alloc(TT_SIZE * sizeof(TTBucket));
+#ifdef USE_NUMA
+	// The interleave policy is applied to the mapping before any page is faulted in
+	if (numa_policy == TT_NUMA_INTERLEAVE && tt_numa_nodes() > 1)
+		numa_interleave_memory(TT, TT_SIZE * sizeof(TTBucket), numa_all_nodes_ptr);
+#endif
+}
+
+void TTable::release() {
+	if (!shm) {
+		large_free(TT, TT_SIZE * sizeof(TTBucket));
+		return;
+	}
+#if defined(__linux__) || defined(__APPLE__)
+	const bool last = shm->refs.fetch_sub(1) == 1;
+	munmap(shm, TT_SHM_HEADER + TT_SIZE * sizeof(TTBucket));
+	if (last)
+		shm_unlink(shm_name.c_str());
+#endif
+	shm = nullptr;
+	shm_name.clear();
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+// Removes the segment behind `path`, unless the name has meanwhile been given to a new segment
+static void shm_unlink_if(const std::string &path, int fd) {
+	struct stat ours, named;
+	int other = shm_open(path.c_str(), O_RDWR, 0600);
+	if (other < 0)
+		return;
+	if (fstat(fd, &ours) == 0 && fstat(other, &named) == 0 && ours.st_dev == named.st_dev && ours.st_ino == named.st_ino)
+		shm_unlink(path.c_str());
+	close(other);
+}
+#endif
+
+bool TTable::attach_shared(const std::string &name) {
+#if defined(__linux__) || defined(__APPLE__)
+	wait_clear();
+	const std::string path = name[0] == '/' ? name : "/" + name;
+	if (shm && path == shm_name)
+		return true;
+
+	// Retried when the segment is stale or the last process detached while we were attaching
+	for (int attempt = 0; attempt < 3; attempt++) {
+		bool created = true;
+		int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST) {
+			created = false;
+			fd = shm_open(path.c_str(), O_RDWR, 0600);
+		}
+		if (fd < 0) {
+			if (errno == ENOENT)
+				continue; // Unlinked between the two opens
+			return false;
+		}
+
+		size_t size = TT_SIZE;
+		if (created) {
+			if (ftruncate(fd, TT_SHM_HEADER + size * sizeof(TTBucket)) != 0) {
+				shm_unlink(path.c_str());
+				close(fd);
+				return false;
+			}
+		} else {
+			// The creator sizes the segment right after creating it, give it a moment
+			struct stat st;
+			int tries = 0;
+			for (; fstat(fd, &st) == 0 && (size_t)st.st_size <= TT_SHM_HEADER && tries < 1000; tries++)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			if (tries == 1000) {
+				std::cout << "info string Shared hash " << path << " was never sized, replacing it" << std::endl;
+				shm_unlink_if(path, fd);
+				close(fd);
+				continue;
+			}
+			if ((st.st_size - TT_SHM_HEADER) % sizeof(TTBucket)) {
+				close(fd);
+				return false;
 			}
+			size = (st.st_size - TT_SHM_HEADER) / sizeof(TTBucket);
+		}
+
+		void *ptr = mmap(nullptr, TT_SHM_HEADER + size * sizeof(TTBucket), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			if (created)
+				shm_unlink(path.c_str());
+			close(fd);
+			return false;
+		}
+		TTShmHeader *header = (TTShmHeader *)ptr;
+		TTBucket *buckets = (TTBucket *)((char *)ptr + TT_SHM_HEADER);
 
-			if (nentry.depth - ((TT_GEN_SZ + age - nentry.age()) % TT_GEN_SZ) * 4 < entry.depth - ((TT_GEN_SZ + age - entry.age()) % TT_GEN_SZ) * 4) {
-				entry = nentry;
-				idx = i;
+		if (!created) {
+			// Wait until the creator has cleared the buckets. If it never finishes, it died on the way.
+			int tries = 0;
+			for (; !header->ready.load() && tries < 60000; tries++)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			if (tries == 60000) {
+				std::cout << "info string Shared hash " << path << " was never initialized, replacing it" << std::endl;
+				munmap(ptr, TT_SHM_HEADER + size * sizeof(TTBucket));
+				shm_unlink_if(path, fd);
+				close(fd);
+				continue;
+			}
+			if (header->magic != TT_SHM_MAGIC || header->bucket_bytes != sizeof(TTBucket) || header->tt_size != size) {
+				munmap(ptr, TT_SHM_HEADER + size * sizeof(TTBucket));
+				close(fd);
+				return false;
+			}
+			if (header->refs.fetch_add(1) == 0) {
+				// The last process detached after we opened the segment, so it is (being) unlinked
+				header->refs.fetch_sub(1);
+				munmap(ptr, TT_SHM_HEADER + size * sizeof(TTBucket));
+				close(fd);
+				continue;
 			}
 		}
+		close(fd);
+
+		if (!shm)
+			private_size = TT_SIZE;
+		release();
+		shm = header;
+		shm_name = path;
+		TT = buckets;
+		TT_SIZE = size;
+
+		if (created) {
+#if defined(__linux__)
+			madvise(TT, TT_SIZE * sizeof(TTBucket), MADV_HUGEPAGE); // Honored if shmem THP is enabled
+#endif
+#ifdef USE_NUMA
+			if (numa_policy == TT_NUMA_INTERLEAVE && tt_numa_nodes() > 1)
+				numa_interleave_memory(TT, TT_SIZE * sizeof(TTBucket), numa_all_nodes_ptr);
+#endif
+			init_ttable();
+			header->magic = TT_SHM_MAGIC;
+			header->bucket_bytes = sizeof(TTBucket);
+			header->tt_size = TT_SIZE;
+			header->age = age.load();
+			header->refs = 1;
+			header->ready = 1;
+		} else {
+			age = header->age % TT_GEN_SZ;
+			fill_base = tt_stats_total().fills;
+		}
+		return true;
 	}
+	return false;
+#else
+	return false;
+#endif
+}
+
+void TTable::detach_shared() {
+	if (!shm)
+		return;
+	wait_clear();
+	release();
+	TT_SIZE = private_size;
+	allocate();
+	init_ttable();
+}
+
+void TTable::init_ttable(const TTBucket *old, size_t old_size) {
+	// Multithreaded initialization (capped by thread count)
+	const size_t MIN_CHUNK_SIZE = 4294967296 / sizeof(TTBucket);
+	const size_t nodes = tt_numa_nodes();
+	size_t num_threads = std::clamp(TT_SIZE / MIN_CHUNK_SIZE, (size_t)1, (size_t)std::thread::hardware_concurrency());
+	if (numa_policy == TT_NUMA_LOCAL)
+		num_threads = std::max(num_threads, nodes); // Every node needs at least one thread to touch its slice
+	std::vector<std::thread> threads;
+	std::atomic<size_t> migrated_live = 0;
+	size_t chunk_size = TT_SIZE / num_threads;
+	for (size_t t = 0; t < num_threads; t++) {
+		threads.emplace_back([this, t, chunk_size, num_threads, nodes, old, old_size, &migrated_live]() {
+#ifdef USE_NUMA
+			// Chunks are assigned to nodes in contiguous runs, so the first touch puts each slice on its node
+			if (numa_policy == TT_NUMA_LOCAL && nodes > 1)
+				numa_run_on_node(t * nodes / num_threads);
+#endif
+			size_t start = t * chunk_size;
+			size_t end = (t == num_threads - 1) ? TT_SIZE : start + chunk_size;
+			if (old)
+				migrated_live.fetch_add(migrate_range(start, end, old, old_size), std::memory_order_relaxed);
+			else
+				clear_range(start, end);
+		});
+	}
+	for (auto &th : threads)
+		th.join();
+	if (!old)
+		age = 0;
+	// Migrated entries of the current search still count as filled. Wraps around if there are more of
+	// them than fills so far, which occupancy's unsigned subtraction undoes.
+	fill_base = tt_stats_total().fills - migrated_live.load();
+}
+
+void TTable::clear_range(size_t start, size_t end) {
+	for (size_t i = start; i < end; i++) {
+		for (int j = 0; j < TT_BUCKET_SZ; j++) {
+			TT[i].set(j, TTEntry());
+		}
+	}
+}
+
+/**
+ * Only the low 16 bits of a key survive in the table, so we cannot recompute the exact new bucket of
+ * an entry. However, the bucket index is monotonic in the key, so new bucket j can only receive keys
+ * from the contiguous run of old buckets whose key ranges overlap its own. Every new bucket takes the
+ * best entries of that run, which means that when growing, an entry is copied to each of the new
+ * buckets its old one was split into. Copies in the wrong bucket are never probed successfully and
+ * simply get replaced like any other stale entry.
+ *
+ * Each new bucket is written by exactly one thread and the old table is only read, so no
+ * synchronization is needed between threads.
+ */
+size_t TTable::migrate_range(size_t start, size_t end, const TTBucket *old, size_t old_size) {
+	std::vector<std::pair<int, TTEntry>> candidates;
+	size_t live = 0;
+	for (size_t j = start; j < end; j++) {
+		// Keys in bucket j are [j * 2^64 / TT_SIZE, (j + 1) * 2^64 / TT_SIZE), map both ends into the old table
+		const size_t lo = (unsigned __int128)j * old_size / TT_SIZE;
+		const size_t hi = std::min(old_size - 1, (size_t)(((unsigned __int128)(j + 1) * old_size - 1) / TT_SIZE));
+
+		candidates.clear();
+		for (size_t i = lo; i <= hi; i++) {
+			for (int k = 0; k < TT_BUCKET_SZ; k++) {
+				const TTEntry entry = old[i].get(k);
+				if (entry.valid()) {
+					// Same priority as the replacement policy in store
+					const int prio = entry.depth - ((TT_GEN_SZ + age - entry.age()) % TT_GEN_SZ) * 4;
+					candidates.emplace_back(prio, entry);
+				}
+			}
+		}
+
+		const size_t kept = std::min(candidates.size(), (size_t)TT_BUCKET_SZ);
+		std::partial_sort(candidates.begin(), candidates.begin() + kept, candidates.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+		for (size_t k = 0; k < TT_BUCKET_SZ; k++)
+			TT[j].set(k, k < kept ? candidates[k].second : TTEntry());
+		for (size_t k = 0; k < kept; k++)
+			live += candidates[k].second.age() == age;
+	}
+	return live;
+}
+
+void TTable::resize(size_t size, bool keep) {
+	wait_clear();
+	if (shm) {
+		private_size = size; // Other processes rely on the layout of the segment
+		return;
+	}
+	if (!keep) {
+		if (size != TT_SIZE) {
+			large_free(TT, TT_SIZE * sizeof(TTBucket));
+			TT_SIZE = size;
+			allocate();
+		}
+		init_ttable();
+		return;
+	}
+	if (size == TT_SIZE)
+		return;
+
+	// Both tables are mapped at the same time while the entries are moved over
+	TTBucket *old = TT;
+	const size_t old_size = TT_SIZE;
+	TT_SIZE = size;
+	allocate();
+	init_ttable(old, old_size);
+	large_free(old, old_size * sizeof(TTBucket));
+}
+
+void TTable::clear() {
+	wait_clear();
+	if (shm)
+		return; // Other processes may still be searching with its contents
+
+	// The pages are already placed, so unlike init_ttable any thread may clear any chunk
+	clear_next = 0;
+	clear_done = 0;
+	clear_chunks = (TT_SIZE + TT_CLEAR_CHUNK - 1) / TT_CLEAR_CHUNK;
+	age = 0;
+	fill_base = tt_stats_total().fills;
+}
+
+void TTable::help_clear() {
+	size_t chunk;
+	while ((chunk = clear_next.fetch_add(1, std::memory_order_relaxed)) < clear_chunks) {
+		clear_range(chunk * TT_CLEAR_CHUNK, std::min(TT_SIZE, (chunk + 1) * TT_CLEAR_CHUNK));
+		if (clear_done.fetch_add(1, std::memory_order_release) + 1 == clear_chunks)
+			clear_done.notify_all();
+	}
+}
+
+void TTable::wait_clear() {
+	if (clear_done.load(std::memory_order_acquire) == clear_chunks)
+		return;
+
+	// Help with the remaining chunks instead of just sleeping, then wait for the ones other threads claimed
+	help_clear();
+	for (size_t done; (done = clear_done.load(std::memory_order_acquire)) != clear_chunks;)
+		clear_done.wait(done);
+}
+
+void TTable::inc_gen() {
+	if (shm) {
+		// Only advance the shared generation if no other process has done so since our last search,
+		// otherwise adopt theirs. Every process then moves the age at most once per search of its own,
+		// however many are attached, instead of the generations adding up.
+		uint8_t seen = age;
+		age = shm->age.compare_exchange_strong(seen, (seen + 1) % TT_GEN_SZ) ? (seen + 1) % TT_GEN_SZ : seen % TT_GEN_SZ;
+	} else {
+		age = (age + 1) % TT_GEN_SZ;
+	}
+	fill_base = tt_stats_total().fills; // No slot holds an entry of the new search yet
+}
+
+TTStats TTable::stats() const {
+	TTStats total = tt_stats_total();
+	total -= stats_base;
+	return total;
+}
+
+void TTable::reset_stats() { stats_base = tt_stats_total(); }
+
+uint64_t TTable::occupancy() const { return std::min(mxsize(), tt_stats_total().fills - fill_base); }
+
+void TTable::age_histogram(uint64_t (&hist)[TT_GEN_SZ + 1]) const {
+	std::fill(hist, hist + TT_GEN_SZ + 1, 0);
+	const size_t step = std::max<size_t>(1, TT_SIZE / 65536);
+	for (size_t i = 0; i < TT_SIZE; i += step) {
+		for (int j = 0; j < TT_BUCKET_SZ; j++) {
+			const TTEntry entry = TT[i].get(j);
+			if (entry.valid())
+				hist[(TT_GEN_SZ + age - entry.age()) % TT_GEN_SZ]++;
+			else
+				hist[TT_GEN_SZ]++;
+		}
+	}
+}
+
+void TTable::report_stats(std::ostream &out) const {
+	const TTStats st = stats();
+	const auto pct = [](uint64_t num, uint64_t den) {
+		std::ostringstream ss;
+		ss << std::fixed << std::setprecision(1) << (den ? 100.0 * num / den : 0.0) << "%";
+		return ss.str();
+	};
+
+	out << "info string TT " << placement() << ", " << mxsize() << " entries, " << pct(occupancy(), mxsize()) << " filled by the current search" << std::endl;
+	out << "info string TT probes " << st.probes << " hits " << st.hits << " (" << pct(st.hits, st.probes) << ") misses " << st.probes - st.hits << std::endl;
+	out << "info string TT stores " << st.stores << " skipped " << st.skipped << " collisions " << st.collisions << " (" << pct(st.collisions, st.stores - st.skipped)
+		<< " of writes evicted a live entry)" << std::endl;
+
+	const char *bounds[4] = {"exact", "lower", "upper", "none"};
+	for (int b = 0; b < 4; b++) {
+		out << "info string TT writes " << bounds[b] << " depth 0: " << st.writes[0][b] << " 1-3: " << st.writes[1][b] << " 4-7: " << st.writes[2][b]
+			<< " 8-15: " << st.writes[3][b] << " 16+: " << st.writes[4][b] << std::endl;
+	}
+
+	uint64_t hist[TT_GEN_SZ + 1];
+	age_histogram(hist);
+	uint64_t sampled = 0;
+	for (uint64_t cnt : hist)
+		sampled += cnt;
+	out << "info string TT ages (searches ago) empty: " << pct(hist[TT_GEN_SZ], sampled);
+	for (int a = 0; a < TT_GEN_SZ; a++) {
+		if (hist[a])
+			out << " " << a << ": " << pct(hist[a], sampled);
+	}
+	out << std::endl;
+}
+
+std::string TTable::placement() const {
+	const int nodes = tt_numa_nodes();
+	const std::string size = std::to_string(TT_SIZE * sizeof(TTBucket) / (1024 * 1024)) + " MB";
+	const std::string pages = ", " + (shm ? "shared as " + shm_name + " by " + std::to_string(shm->refs.load()) + " processes" : large_page_desc(TT));
+	if (nodes <= 1)
+		return size + " on a single NUMA node" + pages;
+	if (numa_policy == TT_NUMA_INTERLEAVE)
+		return size + " interleaved across " + std::to_string(nodes) + " NUMA nodes" + pages;
+	if (numa_policy == TT_NUMA_LOCAL)
+		return size + " split into " + std::to_string(nodes) + " node-local slices" + pages;
+	return size + " placed by first touch" + pages;
+}
+
+void TTable::store(uint64_t key, Value eval, Value s_eval, uint8_t depth, uint8_t bound, bool ttpv, Move best_move) {
+	TTBucket *bucket = TT + index(key);
+
+	key = (uint16_t)key; // Use lower 16 bits for the key (the upper bits already selected the bucket)
+
+	/**
+	 * The entry to replace is the first one with our key, or otherwise the one with the lowest
+	 * depth after penalizing old entries. Empty entries are always replaced first.
+	 *
+	 * A bucket is exactly one cache line, so the priorities of all entries are computed at once
+	 * in vector registers and only the final minimum is scalar.
+	 */
+	u64x8 data, keys;
+	bucket->load(data, keys);
+
+	const i64x8 edepth = (i64x8)((data >> 48) & 0xff);
+	const i64x8 eflags = (i64x8)(data >> 56);
+	i64x8 prio = edepth - ((TT_GEN_SZ + age - (eflags >> 3)) % TT_GEN_SZ) * 4;
+	prio = (eflags & 3) == (int64_t)NONE ? i64x8{} - 1024 : prio;
+	prio = keys == key ? i64x8{} - 2048 : prio;
+
+	uint8_t idx = 0;
+	for (uint8_t i = 1; i < TT_BUCKET_SZ; i++) {
+		if (prio[i] < prio[idx])
+			idx = i;
+	}
+
+	TTEntry entry(keys[idx], data[idx]);
+
+	TTStats &st = count_stats ? local_stats() : tt_stats_discard;
+	bump(st.stores);
+	const bool live = entry.valid() && entry.age() == age;
 
 	if (best_move == NullMove && entry.key == key)
 		best_move = entry.best_move; // Preserve best move if none given
@@ -62,19 +602,107 @@ void TTable::store(uint64_t key, Value eval, Value s_eval, uint8_t depth, uint8_
 		entry.depth = depth;
 		entry.flags = bound | (ttpv ? TTPV : 0) | (age << 3);
 		entry.best_move = best_move;
-		
-		bucket->entries[idx] = entry;
+
+		bucket->set(idx, entry);
+
+		bump(st.writes[tt_depth_class(depth)][bound]);
+		if (!live)
+			bump(st.fills);
+		else if (keys[idx] != key)
+			bump(st.collisions);
+	} else {
+		bump(st.skipped);
 	}
 }
 
 std::optional<TTable::TTEntry> TTable::probe(uint64_t key) {
-	TTBucket *bucket = TT + (key & (TT_SIZE - 1));
-	key >>= 48;
-	for (int i = 0; i < 3; i++) {
-		TTEntry *entry = &bucket->entries[i];
-		if (entry->key != key)
-			continue;
-		return *entry;
+	TTBucket *bucket = TT + index(key);
+	key = (uint16_t)key;
+
+	TTStats &st = count_stats ? local_stats() : tt_stats_discard;
+	bump(st.probes);
+
+	u64x8 data, keys;
+	bucket->load(data, keys);
+	for (int i = 0; i < TT_BUCKET_SZ; i++) {
+		if (keys[i] == key) {
+			bump(st.hits);
+			return TTEntry(key, data[i]);
+		}
 	}
 	return {};
 }
+
+bool TTable::save(const std::string &path) {
+	wait_clear();
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+		return false;
+
+	TTFileHeader header;
+	header.tt_size = TT_SIZE;
+	header.age = age;
+	file.write((const char *)&header, sizeof(header)); // Rewritten with the checksum at the end
+
+	const char *ptr = (const char *)TT;
+	const size_t bytes = TT_SIZE * sizeof(TTBucket);
+	uint64_t checksum = 0;
+	for (size_t done = 0; done < bytes && file; done += TT_FILE_CHUNK) {
+		const size_t len = std::min((size_t)TT_FILE_CHUNK, bytes - done);
+		checksum = tt_checksum(ptr + done, len, checksum);
+		file.write(ptr + done, len);
+	}
+
+	header.checksum = checksum;
+	file.seekp(0);
+	file.write((const char *)&header, sizeof(header));
+	return (bool)file;
+}
+
+bool TTable::load(const std::string &path) {
+	wait_clear();
+	if (shm)
+		return false; // Would pull the table out from under the other processes
+
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	TTFileHeader header, expected;
+	if (!file.read((char *)&header, sizeof(header)))
+		return false;
+	if (header.magic != expected.magic || header.version != expected.version || header.bucket_bytes != expected.bucket_bytes
+		|| header.bucket_entries != expected.bucket_entries || header.tt_size == 0 || header.age >= TT_GEN_SZ)
+		return false;
+
+	// The size has to match the file before resize() throws away the current table for it
+	file.seekg(0, std::ios::end);
+	const std::streamoff file_bytes = file.tellg();
+	file.seekg(sizeof(header));
+	if (header.tt_size > (uint64_t)MAX_TT * 1024 * 1024 / sizeof(TTBucket) || file_bytes < 0
+		|| header.tt_size * sizeof(TTBucket) + sizeof(header) != (uint64_t)file_bytes || !file)
+		return false;
+
+	resize(header.tt_size, false); // Also places the pages according to the NUMA policy before we fill them
+
+	char *ptr = (char *)TT;
+	const size_t bytes = TT_SIZE * sizeof(TTBucket);
+	uint64_t checksum = 0;
+	for (size_t done = 0; done < bytes; done += TT_FILE_CHUNK) {
+		const size_t len = std::min((size_t)TT_FILE_CHUNK, bytes - done);
+		if (!file.read(ptr + done, len)) {
+			init_ttable();
+			return false;
+		}
+		checksum = tt_checksum(ptr + done, len, checksum);
+	}
+
+	if (checksum != header.checksum) {
+		init_ttable();
+		return false;
+	}
+
+	age = header.age;
+	return true;
+}
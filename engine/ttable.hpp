@@ -23,7 +23,35 @@
 #include "move.hpp"
 
 #define DEFAULT_TT_SIZE (16 * 1024 * 1024 / sizeof(TTable::TTBucket)) // 16 MB
+#define MAX_TT (33554432) // Largest Hash in MB, 32 TB
 #define TT_GEN_SZ 32
+#define TT_BUCKET_SZ 6 // Entries per bucket
+
+typedef uint64_t u64x8 __attribute__((vector_size(64)));
+typedef int64_t i64x8 __attribute__((vector_size(64)));
+
+enum TTNumaPolicy {
+	TT_NUMA_NONE, // Pages land wherever the clearing threads happen to run
+	TT_NUMA_INTERLEAVE, // Pages are interleaved round-robin across all nodes
+	TT_NUMA_LOCAL, // Each node first-touches one contiguous slice of the table
+};
+
+#define TT_STATS_DEPTHS 5 // Depth classes for write counts: 0, 1-3, 4-7, 8-15, 16+
+
+/**
+ * TT counters of a single thread. Each thread only ever writes its own copy (with plain relaxed
+ * stores, no read-modify-write), and readers sum all copies, so collecting these costs no shared
+ * cache-line traffic during search.
+ */
+struct TTStats {
+	uint64_t probes = 0, hits = 0;
+	uint64_t stores = 0, skipped = 0; // Stores that were rejected by the replacement policy
+	uint64_t collisions = 0; // Writes that evicted a live entry of the current search with a different key
+	uint64_t fills = 0; // Writes into a slot that held no entry of the current search
+	uint64_t writes[TT_STATS_DEPTHS][4] = {}; // Indexed by depth class and bound
+
+	TTStats &operator-=(const TTStats &o);
+};
 
 enum TTFlag {
 	EXACT = 0,
@@ -42,53 +70,148 @@ struct TTable {
 		uint8_t flags; // 0: exact, 1: lower bound, 2: upper, 3: empty - 1 byte
 
 		TTEntry() : key(0), best_move(NullMove), eval(-VALUE_INFINITE), s_eval(0), depth(0), flags(NONE) {}
+		TTEntry(uint16_t key, uint64_t data)
+			: key(key), best_move(Move(data)), eval(data >> 16), s_eval(data >> 32), depth(data >> 48), flags(data >> 56) {}
 		const bool valid() const { return flags != NONE; }
 		const TTFlag bound() const { return TTFlag(flags & 3); }
 		const bool ttpv() const { return (flags >> 2) & 1; }
 		const uint8_t age() const { return flags >> 3; }
+
+		// Everything except the key, packed into a single word so it can be written atomically
+		const uint64_t data() const {
+			return (uint64_t)best_move.data | (uint64_t)(uint16_t)eval << 16 | (uint64_t)(uint16_t)s_eval << 32 | (uint64_t)depth << 48 | (uint64_t)flags << 56;
+		}
 	};
 
-	struct alignas(32) TTBucket {
-		TTEntry entries[3]; // 3 * 10 = 30 bytes
-		uint8_t pad[2]; // 2 bytes of padding to allow for better alignment (good compilers will do this automatically, but just to be sure)
+	/**
+	 * Entries are shared by every search thread without any locking, so a probe can race with a
+	 * store to the same slot and observe half of each. To detect this, we store the key XORed with
+	 * a fold of the data word. A torn read then decodes to a key that no longer matches the probe
+	 * (except with probability ~2^-16, the same as an ordinary key collision) and is treated as a miss.
+	 */
+	struct alignas(64) TTBucket {
+		std::atomic<uint64_t> data[TT_BUCKET_SZ]; // 6 * 8 = 48 bytes
+		std::atomic<uint16_t> check[TT_BUCKET_SZ]; // 6 * 2 = 12 bytes
+		uint8_t pad[4]; // 4 bytes of padding so that each bucket fills exactly one cache line
+
+		static constexpr uint16_t fold(uint64_t data) { return data ^ (data >> 16) ^ (data >> 32) ^ (data >> 48); }
+
+		TTEntry get(int i) const {
+			const uint64_t d = data[i].load(std::memory_order_relaxed);
+			const uint16_t c = check[i].load(std::memory_order_relaxed);
+			return TTEntry(c ^ fold(d), d);
+		}
+
+		/**
+		 * Snapshots the whole bucket into vector registers and decodes the keys. Lanes past
+		 * TT_BUCKET_SZ are padding and must be ignored by the caller.
+		 */
+		void load(u64x8 &d, u64x8 &k) const {
+			d = k = u64x8{};
+			for (int i = 0; i < TT_BUCKET_SZ; i++) {
+				d[i] = data[i].load(std::memory_order_relaxed);
+				k[i] = check[i].load(std::memory_order_relaxed);
+			}
+			k = (k ^ d ^ (d >> 16) ^ (d >> 32) ^ (d >> 48)) & 0xffff;
+		}
+
+		void set(int i, const TTEntry &entry) {
+			const uint64_t d = entry.data();
+			data[i].store(d, std::memory_order_relaxed);
+			check[i].store(entry.key ^ fold(d), std::memory_order_relaxed);
+		}
 	};
 
 	TTEntry NO_ENTRY = TTEntry();
 
 	TTBucket *TT;
 	size_t TT_SIZE;
-	uint8_t age = 0;
-
-	void init_ttable() {
-		// Multithreaded initialization (capped by thread count)
-		const size_t MIN_CHUNK_SIZE = 4294967296 / sizeof(TTBucket);
-		size_t num_threads = std::clamp(TT_SIZE / MIN_CHUNK_SIZE, (size_t)1, (size_t)std::thread::hardware_concurrency());
-		std::vector<std::thread> threads;
-		size_t chunk_size = TT_SIZE / num_threads;
-		for (int t = 0; t < num_threads; t++) {
-			threads.emplace_back([this, t, chunk_size, num_threads]() {
-				size_t start = t * chunk_size;
-				size_t end = (t == num_threads - 1) ? TT_SIZE : start + chunk_size;
-				for (size_t i = start; i < end; i++) {
-					for (int j = 0; j < 3; j++) {
-						new (&TT[i].entries[j]) TTEntry();
-					}
-				}
-			});
-		}
-		for (auto &th : threads)
-			th.join();
-		age = 0;
-	}
+	std::atomic<uint8_t> age = 0; // Atomic because batch workers sharing the table advance it while others search
+
+	// Whether probes and stores feed the per-thread counters, which describe the global table only
+	bool count_stats = true;
+
+	// Where the pages of the table live on multi-socket machines
+	TTNumaPolicy numa_policy = TT_NUMA_INTERLEAVE;
+
+	// Background clearing state, see `clear`
+	std::atomic<size_t> clear_next = 0, clear_done = 0;
+	size_t clear_chunks = 0;
+
+	// Set while the table lives in a shared-memory segment, see `attach_shared`
+	struct TTShmHeader *shm = nullptr;
+	std::string shm_name;
+	size_t private_size = 0; // Size of the table to go back to on detach_shared
+
+	void allocate();
+
+	// Frees the table, or detaches from the shared segment
+	void release();
 
-	void inc_gen() { age = (age + 1) % TT_GEN_SZ; }
+	void clear_range(size_t start, size_t end);
 
-	TTable(size_t size) : TT_SIZE(size) {
-		TT = (TTBucket *)large_alloc(TT_SIZE * sizeof(TTBucket));
+	// Returns how many of the entries it copied belong to the current search, see `occupancy`
+	size_t migrate_range(size_t start, size_t end, const TTBucket *old, size_t old_size);
+
+	/**
+	 * Fills the freshly allocated table, splitting the work over several threads so that the first
+	 * touch places the pages according to the NUMA policy. The buckets are emptied, or filled from
+	 * `old` (a table of `old_size` buckets) when it is given.
+	 */
+	void init_ttable(const TTBucket *old = nullptr, size_t old_size = 0);
+
+	/**
+	 * Starts emptying the table and returns immediately. The work is split into small chunks that
+	 * any thread can claim with `help_clear`; the search pool's idle threads do so after a
+	 * ucinewgame (see Pool::clear_tt), so `wait_clear` only has to wait for (and helps with)
+	 * whatever is left. The table must not be probed until `wait_clear` has returned.
+	 */
+	void clear();
+
+	// Clears chunks of a pending `clear` until none are left to claim
+	void help_clear();
+
+	void wait_clear();
+
+	// Counter snapshots subtracted from the live totals, see `stats` and `occupancy`
+	TTStats stats_base;
+	uint64_t fill_base = 0;
+
+	void inc_gen();
+
+	// Sum of the counters of all threads since the last `reset_stats`
+	TTStats stats() const;
+
+	void reset_stats();
+
+	/**
+	 * Number of slots written during the current search, maintained incrementally by `store` so
+	 * it is cheap enough to report with every UCI info line. Concurrent writes to the same empty
+	 * slot may count twice, so this is an estimate.
+	 */
+	uint64_t occupancy() const;
+
+	// Permille of the table that was filled during the current search, for UCI hashfull
+	int hashfull() const { return std::min<uint64_t>(1000, occupancy() * 1000 / mxsize()); }
+
+	/**
+	 * Counts entries by how many searches ago they were written, sampling at most 65536 evenly
+	 * spaced buckets. Index TT_GEN_SZ holds the empty slots.
+	 */
+	void age_histogram(uint64_t (&hist)[TT_GEN_SZ + 1]) const;
+
+	// Writes a human readable summary as UCI info strings, for the `ttstats` command
+	void report_stats(std::ostream &out) const;
+
+	TTable(size_t size, bool count_stats = true) : TT_SIZE(size), count_stats(count_stats) {
+		allocate();
 		init_ttable();
 	}
 
-	~TTable() { large_free(TT, TT_SIZE * sizeof(TTBucket)); }
+	~TTable() {
+		wait_clear();
+		release();
+	}
 
 	// TTable(const TTable &o) {
 	// 	TT = new TTEntry[TT_SIZE];
@@ -98,28 +221,91 @@ struct TTable {
 
 	TTable &operator=(const TTable &o) {
 		if (this != &o) {
-			large_free(TT, TT_SIZE * sizeof(TTBucket));
+			wait_clear();
+			release();
 			TT_SIZE = o.TT_SIZE;
-			TT = (TTBucket *)large_alloc(TT_SIZE * sizeof(TTBucket));
+			numa_policy = o.numa_policy;
+			allocate();
 			init_ttable();
 		}
 		return *this;
 	}
 
+	/**
+	 * Maps a key to its bucket with a multiply-high instead of a mask, which spreads keys evenly
+	 * over any table size (not just powers of two). The bucket is selected by the high bits of the
+	 * key, so the low bits are left over for verification.
+	 */
+	size_t index(uint64_t key) const { return ((unsigned __int128)key * TT_SIZE) >> 64; }
+
+	void prefetch(uint64_t key) { arch::prefetch(TT + index(key)); }
+
 	void store(uint64_t key, Value eval, Value s_eval, uint8_t depth, uint8_t bound, bool ttpv, Move best_move);
 
 	std::optional<TTEntry> probe(uint64_t key);
 
-	void resize(size_t size) {
-		if (size != TT_SIZE) {
+	/**
+	 * Changes the number of buckets. With `keep` set, the live entries are rehashed into the new
+	 * table (see `migrate_range`) and the old mapping is only freed afterwards, so growing the hash
+	 * during a long analysis does not throw away what has been searched so far. Otherwise the new
+	 * table starts out empty. While the table is shared, the size is only recorded and applied by
+	 * `detach_shared`.
+	 */
+	void resize(size_t size, bool keep = true);
+
+	void set_numa_policy(TTNumaPolicy policy) {
+		wait_clear();
+		if (shm)
+			return; // The pages of a shared table were placed by the process that created it
+		if (policy != numa_policy) {
+			// Pages that were already faulted in keep their placement, so start from a fresh mapping
 			large_free(TT, TT_SIZE * sizeof(TTBucket));
-			TT_SIZE = size;
-			TT = (TTBucket *)large_alloc(TT_SIZE * sizeof(TTBucket));
+			numa_policy = policy;
+			allocate();
 		}
 		init_ttable();
 	}
 
-	constexpr uint64_t mxsize() const { return TT_SIZE * 3; }
+	/**
+	 * Moves the table into the named POSIX shared-memory segment so that several engine processes
+	 * on the same host search with one hash, much like Lazy SMP threads do. The entries are already
+	 * lock-free and validated against torn writes, so nothing else has to change for this to be safe.
+	 *
+	 * The first process creates and clears the segment with its current size; later ones attach
+	 * to it and adopt its size. While attached, the size and NUMA policy are fixed and ucinewgame
+	 * does not clear the table (other processes may still be using it). The segment is removed when
+	 * the last process detaches. Returns false (keeping a private table) on failure.
+	 *
+	 * A segment whose creator died before clearing it (not sized after 1 s, or not ready after 60 s)
+	 * is reported with an info string, unlinked and created anew. A process that crashes while
+	 * attached never drops its reference, so the segment then outlives the last engine; remove it
+	 * by hand (`rm /dev/shm/<name>` on Linux) once no engine is using it.
+	 */
+	bool attach_shared(const std::string &name);
+
+	// Goes back to a private table with the size that was in effect before attaching (or last requested since)
+	void detach_shared();
+
+	bool shared() const { return shm != nullptr; }
+
+	// Describes where the pages of the table were placed, for UCI output
+	std::string placement() const;
+
+	/**
+	 * Writes the table to disk so that a later process can warm-start from it. The file holds a
+	 * small header (table size, bucket layout, current age and a checksum) followed by the raw
+	 * buckets. Must not be called while a search is running.
+	 */
+	bool save(const std::string &path);
+
+	/**
+	 * Replaces the table with one written by `save`, resizing it to the saved size. Returns false if
+	 * the file is missing or incompatible (the table is untouched) or turns out to be truncated or
+	 * corrupt (the table is left empty). Must not be called while a search is running.
+	 */
+	bool load(const std::string &path);
+
+	constexpr uint64_t mxsize() const { return TT_SIZE * TT_BUCKET_SZ; }
 };
 
 extern TTable ttable;